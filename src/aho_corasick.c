@@ -0,0 +1,328 @@
+// Aho-Corasick automaton for matching many fixed strings in a single pass. The
+// trie is built with sorted sibling lists, then turned into one of two forms:
+// small sets get a dense DFA with a full 256-entry transition row per state
+// (failure links are resolved up-front, so every input byte costs a single
+// table load), bigger sets keep the sorted edges of all the states in one
+// shared array and follow failure links while matching. Every occurrence of
+// every string is reported, overlapping ones included.
+
+// 4096 states make a 4MB dense table
+static const size_t AHO_CORASICK_DENSE_MAX_STATES = 4096;
+// edge lists up to this long are scanned linearly instead of bisected
+static const uint32_t AHO_CORASICK_LINEAR_EDGES = 8;
+
+#define AHO_CORASICK_ROOT 0
+#define AHO_CORASICK_NONE UINT32_MAX
+
+typedef struct {
+    size_t state_count;
+    // input bytes go through this table, it lowercases ASCII when caseless
+    uint8_t fold[256];
+
+    // dense form, the next state is dense[state * 256 + byte]
+    uint32_t *dense;
+    // compact form, edges of state s are [edge_start[s], edge_start[s + 1])
+    uint32_t *edge_start, *edge_targets, *fail;
+    uint8_t *edge_bytes;
+    uint32_t root_next[256];
+
+    // index of the string that ends at a state, or AHO_CORASICK_NONE
+    uint32_t *output;
+    // the next state on the failure chain that has an output
+    uint32_t *output_link;
+    // the first state with an output among the state and its output links
+    uint32_t *first_output;
+    size_t *lengths;
+    size_t pattern_count;
+
+    // trie under construction, freed by aho_corasick_build()
+    uint32_t *first_child, *next_sibling;
+    uint8_t *byte;
+    size_t cap;
+} AhoCorasick;
+
+// Where a scan stopped. "pending" is a state whose output is still to be
+// reported at the current position.
+typedef struct {
+    uint32_t state, pending;
+} AhoCorasickCursor;
+
+#define AHO_CORASICK_CURSOR_INIT ((AhoCorasickCursor){ AHO_CORASICK_ROOT, AHO_CORASICK_NONE })
+
+static uint32_t aho_corasick_add_state(AhoCorasick *ac, uint8_t byte) {
+    size_t cap = ac->cap ? ac->cap << 1 : 256;
+    void *p;
+
+    if (ac->state_count == ac->cap) {
+        if (cap > AHO_CORASICK_NONE)
+            return AHO_CORASICK_NONE;
+        if ( !(p = realloc(ac->first_child, cap * sizeof(*ac->first_child))))
+            return AHO_CORASICK_NONE;
+        ac->first_child = p;
+        if ( !(p = realloc(ac->next_sibling, cap * sizeof(*ac->next_sibling))))
+            return AHO_CORASICK_NONE;
+        ac->next_sibling = p;
+        if ( !(p = realloc(ac->output, cap * sizeof(*ac->output))))
+            return AHO_CORASICK_NONE;
+        ac->output = p;
+        if ( !(p = realloc(ac->byte, cap * sizeof(*ac->byte))))
+            return AHO_CORASICK_NONE;
+        ac->byte = p;
+        ac->cap = cap;
+    }
+
+    ac->first_child[ac->state_count] = AHO_CORASICK_NONE;
+    ac->next_sibling[ac->state_count] = AHO_CORASICK_NONE;
+    ac->output[ac->state_count] = AHO_CORASICK_NONE;
+    ac->byte[ac->state_count] = byte;
+    return (uint32_t)ac->state_count++;
+}
+
+static uint32_t aho_corasick_trie_child(const AhoCorasick *ac, uint32_t state, uint8_t byte) {
+    uint32_t child;
+
+    for (child = ac->first_child[state]; child != AHO_CORASICK_NONE; child = ac->next_sibling[child]) {
+        if (ac->byte[child] >= byte)
+            return (ac->byte[child] == byte) ? child : AHO_CORASICK_NONE;
+    }
+    return AHO_CORASICK_NONE;
+}
+
+// Returns 0 if memory allocation failed.
+int aho_corasick_init(AhoCorasick *ac, size_t pattern_count, int caseless) {
+    int i;
+
+    *ac = (AhoCorasick){ .pattern_count = pattern_count };
+    for (i = 0; i < 256; i++)
+        ac->fold[i] = (caseless && i >= 'A' && i <= 'Z') ? (uint8_t)(i | 0x20) : (uint8_t)i;
+    if ( !(ac->lengths = calloc(pattern_count ? pattern_count : 1, sizeof(*ac->lengths))))
+        return 0;
+    return aho_corasick_add_state(ac, 0) == AHO_CORASICK_ROOT;
+}
+
+// Add the string number "index". A string that was already added keeps the
+// index it was first added with. Returns 0 if memory allocation failed.
+int aho_corasick_add(AhoCorasick *ac, size_t index, const void *data, size_t length) {
+    const uint8_t *p = data;
+    uint32_t state = AHO_CORASICK_ROOT, child, *link;
+    uint8_t byte;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        byte = ac->fold[p[i]];
+        if ((child = aho_corasick_trie_child(ac, state, byte)) == AHO_CORASICK_NONE) {
+            if ((child = aho_corasick_add_state(ac, byte)) == AHO_CORASICK_NONE)
+                return 0;
+            // keep the siblings sorted by byte
+            for (link = &ac->first_child[state];
+                 *link != AHO_CORASICK_NONE && ac->byte[*link] < byte;
+                 link = &ac->next_sibling[*link])
+            {
+            }
+            ac->next_sibling[child] = *link;
+            *link = child;
+        }
+        state = child;
+    }
+
+    ac->lengths[index] = length;
+    if (ac->output[state] == AHO_CORASICK_NONE)
+        ac->output[state] = (uint32_t)index;
+    return 1;
+}
+
+static int aho_corasick_build_dense(AhoCorasick *ac, const uint32_t *order) {
+    uint32_t state, child;
+    size_t i;
+    int c;
+
+    if ( !(ac->dense = malloc(ac->state_count * 256 * sizeof(*ac->dense))))
+        return 0;
+
+    // a state's failure target comes before it in BFS order, so its row is
+    // complete when it's copied
+    for (i = 0; i < ac->state_count; i++) {
+        state = order[i];
+        uint32_t *row = &ac->dense[(size_t)state * 256];
+        if (state == AHO_CORASICK_ROOT) {
+            for (c = 0; c < 256; c++)
+                row[c] = AHO_CORASICK_ROOT;
+        } else {
+            memcpy(row, &ac->dense[(size_t)ac->fail[state] * 256], 256 * sizeof(*row));
+        }
+        for (child = ac->first_child[state]; child != AHO_CORASICK_NONE; child = ac->next_sibling[child])
+            row[ac->byte[child]] = child;
+    }
+    return 1;
+}
+
+static int aho_corasick_build_compact(AhoCorasick *ac) {
+    uint32_t state, child, edge = 0;
+    int c;
+
+    ac->edge_start = malloc((ac->state_count + 1) * sizeof(*ac->edge_start));
+    // every state but the root is the target of exactly one edge
+    ac->edge_targets = malloc(ac->state_count * sizeof(*ac->edge_targets));
+    ac->edge_bytes = malloc(ac->state_count * sizeof(*ac->edge_bytes));
+    if (!ac->edge_start || !ac->edge_targets || !ac->edge_bytes)
+        return 0;
+
+    for (state = 0; state < ac->state_count; state++) {
+        ac->edge_start[state] = edge;
+        for (child = ac->first_child[state]; child != AHO_CORASICK_NONE; child = ac->next_sibling[child]) {
+            ac->edge_bytes[edge] = ac->byte[child];
+            ac->edge_targets[edge++] = child;
+        }
+    }
+    ac->edge_start[ac->state_count] = edge;
+
+    for (c = 0; c < 256; c++) {
+        child = aho_corasick_trie_child(ac, AHO_CORASICK_ROOT, (uint8_t)c);
+        ac->root_next[c] = (child == AHO_CORASICK_NONE) ? AHO_CORASICK_ROOT : child;
+    }
+    return 1;
+}
+
+// Compute the failure and output links and build the matching tables. Returns
+// 0 if memory allocation failed.
+int aho_corasick_build(AhoCorasick *ac) {
+    uint32_t *order, state, child, target;
+    size_t head = 0, tail = 0;
+    int ok;
+
+    order = malloc(ac->state_count * sizeof(*order));
+    ac->fail = malloc(ac->state_count * sizeof(*ac->fail));
+    ac->output_link = malloc(ac->state_count * sizeof(*ac->output_link));
+    ac->first_output = malloc(ac->state_count * sizeof(*ac->first_output));
+    if (!order || !ac->fail || !ac->output_link || !ac->first_output) {
+        free(order);
+        return 0;
+    }
+
+    ac->fail[AHO_CORASICK_ROOT] = AHO_CORASICK_ROOT;
+    ac->output_link[AHO_CORASICK_ROOT] = AHO_CORASICK_NONE;
+    ac->first_output[AHO_CORASICK_ROOT] = AHO_CORASICK_NONE;
+    order[tail++] = AHO_CORASICK_ROOT;
+    while (head < tail) {
+        state = order[head++];
+        for (child = ac->first_child[state]; child != AHO_CORASICK_NONE; child = ac->next_sibling[child]) {
+            // the longest proper suffix of the child's string that is in the trie
+            target = AHO_CORASICK_ROOT;
+            if (state != AHO_CORASICK_ROOT) {
+                for (target = ac->fail[state];; target = ac->fail[target]) {
+                    uint32_t next = aho_corasick_trie_child(ac, target, ac->byte[child]);
+                    if (next != AHO_CORASICK_NONE) {
+                        target = next;
+                        break;
+                    }
+                    if (target == AHO_CORASICK_ROOT)
+                        break;
+                }
+            }
+            ac->fail[child] = target;
+            ac->output_link[child] = (ac->output[target] != AHO_CORASICK_NONE)
+                ? target
+                : ac->output_link[target];
+            ac->first_output[child] = (ac->output[child] != AHO_CORASICK_NONE)
+                ? child
+                : ac->output_link[child];
+            order[tail++] = child;
+        }
+    }
+
+    if (ac->state_count <= AHO_CORASICK_DENSE_MAX_STATES)
+        ok = aho_corasick_build_dense(ac, order);
+    else
+        ok = aho_corasick_build_compact(ac);
+
+    free(order);
+    free(ac->first_child);
+    free(ac->next_sibling);
+    free(ac->byte);
+    ac->first_child = ac->next_sibling = NULL;
+    ac->byte = NULL;
+    if (ac->dense) {
+        free(ac->fail);
+        ac->fail = NULL;
+    }
+    return ok;
+}
+
+static inline uint32_t aho_corasick_next_state(const AhoCorasick *ac, uint32_t state, uint8_t byte) {
+    uint32_t lo, hi, end, mid;
+
+    if (ac->dense)
+        return ac->dense[(size_t)state * 256 + byte];
+
+    while (state != AHO_CORASICK_ROOT) {
+        lo = ac->edge_start[state];
+        end = hi = ac->edge_start[state + 1];
+        if (hi - lo <= AHO_CORASICK_LINEAR_EDGES) {
+            for (; lo < hi; lo++) {
+                if (ac->edge_bytes[lo] == byte)
+                    return ac->edge_targets[lo];
+            }
+        } else {
+            while (lo < hi) {
+                mid = lo + ((hi - lo) >> 1);
+                if (ac->edge_bytes[mid] < byte)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < end && ac->edge_bytes[lo] == byte)
+                return ac->edge_targets[lo];
+        }
+        state = ac->fail[state];
+    }
+    return ac->root_next[byte];
+}
+
+// Find the next occurrence that ends in (*offset, end] of "subject", moving
+// *offset to its end. On a hit "start_out" is set to where the occurrence
+// starts and "index_out" to the index of its string. Returns 0 when [*offset,
+// end) has no more occurrences.
+int aho_corasick_next(const AhoCorasick *ac,
+                      AhoCorasickCursor *cursor,
+                      const uint8_t *subject,
+                      size_t *offset,
+                      size_t end,
+                      size_t *start_out,
+                      size_t *index_out)
+{
+    // a pending hit is another string that ends where the last reported one did
+    uint32_t state = cursor->state, hit = cursor->pending;
+    size_t pos = *offset;
+
+    while (hit == AHO_CORASICK_NONE && pos < end) {
+        state = aho_corasick_next_state(ac, state, ac->fold[subject[pos++]]);
+        hit = ac->first_output[state];
+    }
+    cursor->state = state;
+    *offset = pos;
+    if (hit == AHO_CORASICK_NONE) {
+        cursor->pending = AHO_CORASICK_NONE;
+        return 0;
+    }
+
+    cursor->pending = ac->output_link[hit];
+    *index_out = ac->output[hit];
+    *start_out = pos - ac->lengths[ac->output[hit]];
+    return 1;
+}
+
+void aho_corasick_deinit(AhoCorasick *ac) {
+    free(ac->dense);
+    free(ac->edge_start);
+    free(ac->edge_targets);
+    free(ac->edge_bytes);
+    free(ac->fail);
+    free(ac->output);
+    free(ac->output_link);
+    free(ac->first_output);
+    free(ac->lengths);
+    free(ac->first_child);
+    free(ac->next_sibling);
+    free(ac->byte);
+    *ac = (AhoCorasick){ 0 };
+}
@@ -0,0 +1,81 @@
+// Memory for PCRE2's compiled code, match data, contexts and JIT stack headers,
+// handed to PCRE2 through a pcre2_general_context. Blocks are rounded up to a
+// power of 2 size class and recycled through a free list per class, all of
+// them carved from one arena. Blocks bigger than the biggest class come from
+// malloc. An allocator isn't thread-safe: every thread that creates matchers
+// has its own.
+
+#define ALLOCATOR_CLASS_COUNT 12
+
+// classes are 32 bytes to 64KB
+static const size_t ALLOCATOR_MIN_CLASS_SIZE = 32;
+// every block starts with its class, the rest stays aligned for any type
+static const size_t ALLOCATOR_HEADER_SIZE = 16;
+static const size_t ALLOCATOR_ARENA_RESERVE_SIZE = STH_BASE_MB(16);
+static const size_t ALLOCATOR_ARENA_COMMIT_SIZE = STH_BASE_KB(64);
+
+typedef struct {
+    sth_arena_t *arena;
+    sth_mempool_t pools[ALLOCATOR_CLASS_COUNT];
+    pcre2_general_context *context;
+} Allocator;
+
+static void *allocator_malloc(PCRE2_SIZE size, void *data) {
+    Allocator *allocator = data;
+    const size_t total = size + ALLOCATOR_HEADER_SIZE;
+    size_t c = 0;
+    uint8_t *block;
+
+    while (c < ALLOCATOR_CLASS_COUNT && (ALLOCATOR_MIN_CLASS_SIZE << c) < total)
+        c++;
+    if (c == ALLOCATOR_CLASS_COUNT)
+        block = malloc(total);
+    else
+        block = sth_mempool_get(&allocator->pools[c]);
+    if (!block)
+        return NULL;
+
+    memcpy(block, &c, sizeof(c));
+    return block + ALLOCATOR_HEADER_SIZE;
+}
+
+static void allocator_free(void *p, void *data) {
+    Allocator *allocator = data;
+    uint8_t *block;
+    size_t c;
+
+    if (!p)
+        return;
+    block = (uint8_t *)p - ALLOCATOR_HEADER_SIZE;
+    memcpy(&c, block, sizeof(c));
+    if (c == ALLOCATOR_CLASS_COUNT)
+        free(block);
+    else
+        sth_mempool_put(&allocator->pools[c], block);
+}
+
+// The allocator must not move while it's in use, PCRE2 keeps pointers to it.
+int allocator_init(Allocator *allocator) {
+    sth_arena_config_t arena_config = STH_ARENA_DEFAULT_CONFIG;
+    size_t c;
+
+    *allocator = (Allocator){ 0 };
+    arena_config.reserve = ALLOCATOR_ARENA_RESERVE_SIZE;
+    arena_config.commit = ALLOCATOR_ARENA_COMMIT_SIZE;
+    if ( !(allocator->arena = sth_arena_new(arena_config)))
+        return 0;
+    for (c = 0; c < ALLOCATOR_CLASS_COUNT; c++)
+        sth_mempool_init(&allocator->pools[c], allocator->arena, ALLOCATOR_MIN_CLASS_SIZE << c);
+
+    allocator->context = pcre2_general_context_create(allocator_malloc, allocator_free, allocator);
+    return allocator->context != NULL;
+}
+
+// Everything allocated from the allocator must be freed before.
+void allocator_deinit(Allocator *allocator) {
+    if (allocator->context)
+        pcre2_general_context_free(allocator->context);
+    if (allocator->arena)
+        sth_arena_destroy(allocator->arena);
+    *allocator = (Allocator){ 0 };
+}
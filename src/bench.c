@@ -0,0 +1,73 @@
+// --bench-engines: every pattern is matched on its own over the whole input,
+// once with pcre2_match and once with pcre2_dfa_match, and the time spent
+// matching (compiling and JIT compiling excluded) is printed as a TSV row per
+// pattern and engine.
+
+static const char *const BENCH_ENGINE_NAMES[] = { "backtrack", "dfa" };
+static const size_t BENCH_ERROR_BUFFER_SIZE = 256;
+
+static void bench_print_pattern(const MatcherPattern *pattern) {
+    fwrite(pattern->data, 1, pattern->length, stdout);
+    putchar('\n');
+}
+
+// Returns 0 if a pattern failed to compile or to match with some engine, the
+// other rows are still printed.
+int bench_engines(const MatcherPattern *patterns,
+                  size_t pattern_count,
+                  const MatcherOptions *options,
+                  PCRE2_SPTR subject,
+                  PCRE2_SIZE subject_length)
+{
+    PCRE2_UCHAR error_buffer[BENCH_ERROR_BUFFER_SIZE];
+    MatcherOptions bench_options = *options;
+    PCRE2_SPTR substring_start;
+    PCRE2_SIZE substring_length, invalid_offset;
+    uint64_t start_time;
+    double seconds;
+    size_t i, matches;
+    int dfa, ok = 1;
+
+    // the DFA has no capture groups, both engines report the whole matches
+    bench_options.groups = NULL;
+    printf("engine\tmatches\tseconds\tMB/s\tpattern\n");
+    for (i = 0; i < pattern_count; i++) {
+        for (dfa = 0; dfa <= 1; dfa++) {
+            Matcher matcher = { 0 };
+            bench_options.dfa = dfa;
+            printf("%s\t", BENCH_ENGINE_NAMES[dfa]);
+
+            if (!matcher_init(&matcher, &patterns[i], 1, &bench_options, subject, subject_length)
+                || !matcher_check_utf(&matcher, &bench_options, &invalid_offset))
+            {
+                matcher_error_info(&matcher, error_buffer, sizeof(error_buffer));
+                printf("-\t-\t-\t");
+                bench_print_pattern(&patterns[i]);
+                fprintf(stderr, "%s: pattern \'%.*s\': %s\n", BENCH_ENGINE_NAMES[dfa],
+                        (int)patterns[i].length, patterns[i].data, error_buffer);
+                matcher_deinit(&matcher);
+                ok = 0;
+                continue;
+            }
+            matcher_jit_compile(&matcher);
+
+            matches = 0;
+            start_time = sth_os_time_ns();
+            while (matcher_next(&matcher, &substring_start, &substring_length))
+                matches++;
+            seconds = (double)(sth_os_time_ns() - start_time) / 1e9;
+
+            if (matcher.match_error) {
+                pcre2_get_error_message(matcher.match_error, error_buffer, sizeof(error_buffer));
+                fprintf(stderr, "%s: pattern \'%.*s\': matching failed: %s\n", BENCH_ENGINE_NAMES[dfa],
+                        (int)patterns[i].length, patterns[i].data, error_buffer);
+                ok = 0;
+            }
+            printf("%zu\t%.6f\t%.1f\t", matches, seconds,
+                   (seconds > 0) ? (double)subject_length / (1024.0 * 1024.0) / seconds : 0.0);
+            bench_print_pattern(&patterns[i]);
+            matcher_deinit(&matcher);
+        }
+    }
+    return ok;
+}
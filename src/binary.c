@@ -0,0 +1,73 @@
+// Binary input detection. Like grep, input with a NUL byte is binary: text
+// practically never has one, while executables, core dumps and compressed data
+// have plenty of them from the start. NUL bytes are searched with memchr,
+// which is vectorized like the newline searches.
+
+// The size of the first block, checked to tell binary input from text.
+static const size_t BINARY_CHECK_SIZE = 32 * 1024;
+
+typedef enum {
+    // binary input isn't matched at all
+    BINARY_SKIP,
+    // binary input is matched like text
+    BINARY_TEXT,
+    // matching stops at the line of the first NUL byte
+    BINARY_STOP,
+} BinaryMode;
+
+int binary_mode_from_name(const char *name, BinaryMode *mode_out) {
+    if (strcmp(name, "skip") == 0)
+        *mode_out = BINARY_SKIP;
+    else if (strcmp(name, "text") == 0)
+        *mode_out = BINARY_TEXT;
+    else if (strcmp(name, "stop") == 0)
+        *mode_out = BINARY_STOP;
+    else
+        return 0;
+    return 1;
+}
+
+// Find the first NUL byte of [data, data + size) and set *out_text_length to
+// the length of the text before its line. Returns 0 if there's none.
+int binary_find(const uint8_t *data, size_t size, size_t *out_nul_offset, size_t *out_text_length) {
+    const uint8_t *nul, *newline;
+
+    if ( !(nul = memchr(data, '\0', size)))
+        return 0;
+    *out_nul_offset = (size_t)(nul - data);
+    newline = simd_memrchr(data, *out_nul_offset, '\n');
+    *out_text_length = newline ? (size_t)(newline - data) + 1 : 0;
+    return 1;
+}
+
+// Check a subject that starts at "input_offset" in the input for binary data
+// and set *size to the length of its text that is to be matched: all of it,
+// none of it if the input is skipped, or up to the line of its first NUL byte.
+// The first block of the input decides if it's skipped, every subject is
+// checked when matching stops. Returns 0 (with the offset of the NUL byte in
+// the input) if the input is binary, the rest of it isn't matched.
+int binary_check(BinaryMode mode, const uint8_t *subject, size_t *size, size_t input_offset,
+                 size_t *out_nul_offset)
+{
+    size_t nul_offset, text_length, check_size;
+
+    switch (mode) {
+    case BINARY_SKIP:
+        if (input_offset >= BINARY_CHECK_SIZE)
+            return 1;
+        check_size = (*size < BINARY_CHECK_SIZE - input_offset) ? *size : BINARY_CHECK_SIZE - input_offset;
+        if (!binary_find(subject, check_size, &nul_offset, &text_length))
+            return 1;
+        *size = 0;
+        break;
+    case BINARY_STOP:
+        if (!binary_find(subject, *size, &nul_offset, &text_length))
+            return 1;
+        *size = text_length;
+        break;
+    default:
+        return 1;
+    }
+    *out_nul_offset = input_offset + nul_offset;
+    return 0;
+}
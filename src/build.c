@@ -1,5 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define SIMD_HAVE_AVX2 1
+#else
+    #define SIMD_HAVE_AVX2 0
+#endif
 
 #ifndef PCRE2_STATIC
     #define PCRE2_STATIC
@@ -10,6 +25,19 @@
 #include "libbloom/bloom.h"
 
 #include "sth/sth.c"
+#include "simd.c"
+#include "literal.c"
+#include "aho_corasick.c"
+#include "allocator.c"
+#include "hash.c"
+#include "pattern_cache.c"
 #include "regexp.c"
+#include "parallel.c"
+#include "bench.c"
 #include "libbloom/bloom.c"
+#include "string_set.c"
+#include "dedup.c"
+#include "sort.c"
+#include "spill.c"
+#include "binary.c"
 #include "main.c"
@@ -0,0 +1,86 @@
+// Filters out keys that were seen before. The bloom filters use little memory
+// but may drop a unique key on a false positive, the exact mode keeps a copy of
+// every unique key (with its number of occurrences) and never does. The
+// scalable bloom filter grows with the number of unique keys, the blocked one
+// has a fixed size but costs a single cache miss per key.
+
+static const double DEDUP_BLOOM_ERROR = 0.01;
+static const uint64_t DEDUP_HASH_SEED = 0x9747b28c;
+
+typedef enum {
+    DEDUP_BLOOM,
+    DEDUP_BLOCKED,
+    DEDUP_EXACT,
+} DedupMode;
+
+typedef struct {
+    DedupMode mode;
+    struct bloom_scalable bloom;
+    struct bloom_blocked blocked;
+    StringSet set;
+} Dedup;
+
+int dedup_mode_from_name(const char *name, DedupMode *mode_out) {
+    if (strcmp(name, "bloom") == 0)
+        *mode_out = DEDUP_BLOOM;
+    else if (strcmp(name, "blocked") == 0)
+        *mode_out = DEDUP_BLOCKED;
+    else if (strcmp(name, "exact") == 0)
+        *mode_out = DEDUP_EXACT;
+    else
+        return 0;
+    return 1;
+}
+
+// "capacity" is the expected number of unique keys. It's the size of the first
+// slice of the scalable bloom filter and the size of the blocked one.
+int dedup_init(Dedup *dedup, DedupMode mode, unsigned int capacity) {
+    *dedup = (Dedup){ .mode = mode };
+    switch (mode) {
+    case DEDUP_BLOOM:
+        return (bloom_scalable_init(&dedup->bloom, capacity, DEDUP_BLOOM_ERROR) == 0);
+    case DEDUP_BLOCKED:
+        return (bloom_blocked_init(&dedup->blocked, capacity, DEDUP_BLOOM_ERROR) == 0);
+    case DEDUP_EXACT:
+        return string_set_init(&dedup->set, 0);
+    }
+    return 0;
+}
+
+// Returns 1 if the key made of "count" fields is seen for the first time, 0 if
+// it's a duplicate and -1 if memory allocation failed. The key is hashed once
+// and every structure probes with that hash.
+int dedup_insert(Dedup *dedup, const HashField *fields, size_t count) {
+    const uint64_t hash = hash64_fields(fields, count, DEDUP_HASH_SEED);
+
+    switch (dedup->mode) {
+    case DEDUP_BLOOM:
+        switch (bloom_scalable_add_hash(&dedup->bloom, hash)) {
+        case 0:
+            return 1;
+        case 1:
+            return 0;
+        default:
+            return -1;
+        }
+    case DEDUP_BLOCKED:
+        return (bloom_blocked_add_hash(&dedup->blocked, hash) == 0);
+    case DEDUP_EXACT:
+        return string_set_insert(&dedup->set, hash, fields, count);
+    }
+    return -1;
+}
+
+void dedup_deinit(Dedup *dedup) {
+    switch (dedup->mode) {
+    case DEDUP_BLOOM:
+        bloom_scalable_free(&dedup->bloom);
+        break;
+    case DEDUP_BLOCKED:
+        bloom_blocked_free(&dedup->blocked);
+        break;
+    case DEDUP_EXACT:
+        string_set_deinit(&dedup->set);
+        break;
+    }
+}
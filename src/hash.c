@@ -0,0 +1,106 @@
+// 64-bit hash for dedup keys. This is wyhash (final version 4) by Wang Yi,
+// released into the public domain. Reads are done with memcpy so keys don't
+// have to be aligned.
+
+// A part of a key made of several fields, e.g. the capture groups of a match.
+typedef struct {
+    const void *data;
+    size_t length;
+} HashField;
+
+static const uint64_t HASH_SECRET[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+static inline void hash_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b, hi, lo;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read_small(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64_t hash64(const void *key, size_t length, uint64_t seed) {
+    const uint8_t *p = key;
+    uint64_t a, b;
+    size_t i;
+
+    seed ^= hash_mix(seed ^ HASH_SECRET[0], HASH_SECRET[1]);
+    if (STH_BASE_LIKELY(length <= 16)) {
+        if (STH_BASE_LIKELY(length >= 4)) {
+            a = (hash_read32(p) << 32) | hash_read32(p + ((length >> 3) << 2));
+            b = (hash_read32(p + length - 4) << 32) | hash_read32(p + length - 4 - ((length >> 3) << 2));
+        } else if (STH_BASE_LIKELY(length > 0)) {
+            a = hash_read_small(p, length);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = length;
+        if (STH_BASE_UNLIKELY(i > 48)) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(hash_read64(p) ^ HASH_SECRET[1], hash_read64(p + 8) ^ seed);
+                see1 = hash_mix(hash_read64(p + 16) ^ HASH_SECRET[2], hash_read64(p + 24) ^ see1);
+                see2 = hash_mix(hash_read64(p + 32) ^ HASH_SECRET[3], hash_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (STH_BASE_LIKELY(i > 48));
+            seed ^= see1 ^ see2;
+        }
+        while (STH_BASE_UNLIKELY(i > 16)) {
+            seed = hash_mix(hash_read64(p) ^ HASH_SECRET[1], hash_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    a ^= HASH_SECRET[1];
+    b ^= seed;
+    hash_mum(&a, &b);
+    return hash_mix(a ^ HASH_SECRET[0] ^ length, b ^ HASH_SECRET[1]);
+}
+
+// Hash a key made of fields without joining them: every field is hashed with
+// the hash of the fields before it as its seed. A single field hashes like
+// hash64 does.
+uint64_t hash64_fields(const HashField *fields, size_t count, uint64_t seed) {
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        seed = hash64(fields[i].data, fields[i].length, seed);
+    return seed;
+}
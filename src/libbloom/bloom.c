@@ -16,6 +16,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -23,6 +24,13 @@
 #include <string.h>
 #include "bloom.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define __BLOOM_HAVE_AVX2 1
+#else
+    #define __BLOOM_HAVE_AVX2 0
+#endif
+
 #define __BLOOM_MAGIC "libbloom3"
 
 #define __bloom_concat_(A,B) A##B
@@ -31,69 +39,73 @@
     extern char __bloom_concat(id, __LINE__)[ ((condition)) ? 1 : -1 ]
 
 //-----------------------------------------------------------------------------
-// __bloom_murmurhash2, by Austin Appleby
-
-// Note - This code makes a few assumptions about how your machine behaves -
-
-// 1. We can read a 4-byte value from any address without crashing
-// 2. sizeof(int) == 4
-__bloom_static_assert(sizeof(int) == 4, sizeof_int_must_be_4_bytes);
+// __bloom_murmurhash64a, by Austin Appleby
 
-// And it has a few limitations -
+// Note - Blocks are read with memcpy, so keys don't have to be aligned. It
+// has a few limitations -
 
 // 1. It will not work incrementally.
 // 2. It will not produce the same results on little-endian and big-endian
 //    machines.
 
-static unsigned int __bloom_murmurhash2(const void *key, int len, const unsigned int seed)
+__bloom_static_assert(sizeof(unsigned long long) == 8, sizeof_unsigned_long_long_must_be_8_bytes);
+
+static unsigned long long __bloom_murmurhash64a(const void *key,
+                                                int len,
+                                                const unsigned long long seed)
 {
     // 'm' and 'r' are mixing constants generated offline.
     // They're not really 'magic', they just happen to work well.
 
-    const unsigned int m = 0x5bd1e995;
-    const int r = 24;
+    const unsigned long long m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
 
     // Initialize the hash to a 'random' value
 
-    unsigned int h = seed ^ len;
+    unsigned long long h = seed ^ ((unsigned long long)len * m);
 
-    // Mix 4 bytes at a time into the hash
+    // Mix 8 bytes at a time into the hash
 
     const unsigned char *data = (const unsigned char *)key;
+    const unsigned char *end = data + (len / 8) * 8;
 
-    while(len >= 4) {
-        unsigned int k = *(unsigned int *)data;
+    while(data != end) {
+        unsigned long long k;
+        memcpy(&k, data, sizeof(k));
 
         k *= m;
         k ^= k >> r;
         k *= m;
 
-        h *= m;
         h ^= k;
+        h *= m;
 
-        data += 4;
-        len -= 4;
+        data += 8;
     }
 
     // Handle the last few bytes of the input array
 
-    switch(len) {
-        case 3: h ^= data[2] << 16;
-        case 2: h ^= data[1] << 8;
-        case 1: h ^= data[0];
+    switch(len & 7) {
+        case 7: h ^= (unsigned long long)data[6] << 48; // fall through
+        case 6: h ^= (unsigned long long)data[5] << 40; // fall through
+        case 5: h ^= (unsigned long long)data[4] << 32; // fall through
+        case 4: h ^= (unsigned long long)data[3] << 24; // fall through
+        case 3: h ^= (unsigned long long)data[2] << 16; // fall through
+        case 2: h ^= (unsigned long long)data[1] << 8;  // fall through
+        case 1: h ^= (unsigned long long)data[0];
             h *= m;
     };
 
     // Do a few final mixes of the hash to ensure the last few
     // bytes are well-incorporated.
 
-    h ^= h >> 13;
+    h ^= h >> r;
     h *= m;
-    h ^= h >> 15;
+    h ^= h >> r;
 
     return h;
 }
-// End __bloom_murmurhash2
+// End __bloom_murmurhash64a
 //-----------------------------------------------------------------------------
 
 
@@ -115,16 +127,17 @@ inline static int __bloom_test_bit_set_bit(unsigned char *buf,
 }
 
 
+// Both halves of the 64-bit hash are used for double hashing, so an element
+// is hashed once no matter how many bits (or filters) are probed.
 static int __bloom_check_add(struct bloom *bloom,
-                             const void *buffer,
-                             int len,
+                             unsigned long long hash,
                              int add)
 {
     assert(bloom->ready != 0);
 
     unsigned char hits = 0;
-    unsigned int a = __bloom_murmurhash2(buffer, len, 0x9747b28c);
-    unsigned int b = __bloom_murmurhash2(buffer, len, a);
+    unsigned int a = (unsigned int)hash;
+    unsigned int b = (unsigned int)(hash >> 32);
     unsigned long int x;
     unsigned long int i;
 
@@ -146,8 +159,6 @@ static int __bloom_check_add(struct bloom *bloom,
 
 int bloom_init(struct bloom *bloom, unsigned int entries, double error)
 {
-    __bloom_static_assert(sizeof(unsigned long long) == 8, test_sizeof_unsigned_long_long);
-
     memset(bloom, 0, sizeof(struct bloom));
     if (entries < 1000 || error <= 0 || error >= 1)
         return 1;
@@ -183,15 +194,33 @@ int bloom_init(struct bloom *bloom, unsigned int entries, double error)
 }
 
 
+unsigned long long bloom_hash(const void *buffer, int len)
+{
+    return __bloom_murmurhash64a(buffer, len, 0x9747b28c);
+}
+
+
 int bloom_check(struct bloom *bloom, const void *buffer, int len)
 {
-    return __bloom_check_add(bloom, buffer, len, 0);
+    return __bloom_check_add(bloom, bloom_hash(buffer, len), 0);
 }
 
 
 int bloom_add(struct bloom *bloom, const void *buffer, int len)
 {
-    return __bloom_check_add(bloom, buffer, len, 1);
+    return __bloom_check_add(bloom, bloom_hash(buffer, len), 1);
+}
+
+
+int bloom_check_hash(struct bloom *bloom, unsigned long long hash)
+{
+    return __bloom_check_add(bloom, hash, 0);
+}
+
+
+int bloom_add_hash(struct bloom *bloom, unsigned long long hash)
+{
+    return __bloom_check_add(bloom, hash, 1);
 }
 
 
@@ -377,3 +406,277 @@ int bloom_merge(struct bloom *bloom_dest, struct bloom *bloom_src)
 
     return 0;
 }
+
+
+static int __bloom_scalable_add_slice(struct bloom_scalable *bloom)
+{
+    const struct bloom *last;
+    unsigned long int entries;
+    double error;
+
+    if (bloom->slices_count == 0) {
+        entries = bloom->entries;
+        error = bloom->error * (1.0 - BLOOM_SCALABLE_TIGHTENING);
+    } else {
+        if (bloom->slices_count == BLOOM_SCALABLE_MAX_SLICES)
+            return 1;
+        last = &bloom->slices[bloom->slices_count - 1];
+        entries = (unsigned long int)last->entries * BLOOM_SCALABLE_GROWTH;
+        if (entries > UINT_MAX)
+            entries = UINT_MAX;
+        error = last->error * BLOOM_SCALABLE_TIGHTENING;
+    }
+
+    if (bloom_init(&bloom->slices[bloom->slices_count], (unsigned int)entries, error))
+        return 1;
+
+    bloom->slices_count++;
+    bloom->last_slice_count = 0;
+    return 0;
+}
+
+
+int bloom_scalable_init(struct bloom_scalable *bloom, unsigned int entries, double error)
+{
+    memset(bloom, 0, sizeof(struct bloom_scalable));
+    if (entries < 1000 || error <= 0 || error >= 1)
+        return 1;
+
+    bloom->entries = entries;
+    bloom->error = error;
+    if (__bloom_scalable_add_slice(bloom))
+        return 1;
+
+    bloom->ready = 1;
+    return 0;
+}
+
+
+int bloom_scalable_check(struct bloom_scalable *bloom, const void *buffer, int len)
+{
+    return bloom_scalable_check_hash(bloom, bloom_hash(buffer, len));
+}
+
+
+int bloom_scalable_add(struct bloom_scalable *bloom, const void *buffer, int len)
+{
+    return bloom_scalable_add_hash(bloom, bloom_hash(buffer, len));
+}
+
+
+int bloom_scalable_check_hash(struct bloom_scalable *bloom, unsigned long long hash)
+{
+    int i;
+
+    if (!bloom->ready)
+        return -1;
+
+    // newest slices are the biggest ones, so most elements are found there
+    for (i = bloom->slices_count - 1; i >= 0; i--) {
+        if (bloom_check_hash(&bloom->slices[i], hash))
+            return 1;
+    }
+    return 0;
+}
+
+
+int bloom_scalable_add_hash(struct bloom_scalable *bloom, unsigned long long hash)
+{
+    int present = bloom_scalable_check_hash(bloom, hash);
+    if (present != 0)
+        return present;
+
+    if (bloom->last_slice_count >= bloom->slices[bloom->slices_count - 1].entries) {
+        if (__bloom_scalable_add_slice(bloom))
+            return -1;
+    }
+
+    bloom_add_hash(&bloom->slices[bloom->slices_count - 1], hash);
+    bloom->last_slice_count++;
+    bloom->count++;
+    return 0;
+}
+
+
+void bloom_scalable_free(struct bloom_scalable *bloom)
+{
+    unsigned char i;
+
+    for (i = 0; i < bloom->slices_count; i++)
+        bloom_free(&bloom->slices[i]);
+    bloom->slices_count = 0;
+    bloom->ready = 0;
+}
+
+
+// Odd multipliers used to derive one bit position per block word from a single
+// 32-bit hash, taken from the Parquet split block bloom filter.
+static const uint32_t __bloom_block_salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+
+// False positive rate of a blocked filter with 'bpe' bits per element. The
+// number of elements in a block follows a Poisson distribution and an element
+// with j others in its block collides if all its word bits are taken.
+static double __bloom_blocked_error(double bpe)
+{
+    const double lambda = (BLOOM_BLOCK_SIZE * 8) / bpe;
+    const int words = BLOOM_BLOCK_WORDS;
+    const int word_bits = (BLOOM_BLOCK_SIZE * 8) / BLOOM_BLOCK_WORDS;
+    double p = exp(-lambda), error = 0;
+    int j;
+
+    for (j = 0; j < lambda * 4 + 64; j++) {
+        error += p * pow(1.0 - pow(1.0 - 1.0 / word_bits, j), words);
+        p *= lambda / (j + 1);
+    }
+    return error;
+}
+
+
+static int __bloom_blocked_check_add_scalar(unsigned long long *block,
+                                            uint32_t hash,
+                                            int add)
+{
+    unsigned long long mask;
+    int i, hits = 0;
+
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        mask = 1ull << ((hash * __bloom_block_salts[i]) >> 26);
+        if (block[i] & mask)
+            hits++;
+        else if (add)
+            block[i] |= mask;
+        else
+            return 0;
+    }
+    return (hits == BLOOM_BLOCK_WORDS);
+}
+
+
+#if __BLOOM_HAVE_AVX2
+__attribute__((target("avx2")))
+static int __bloom_blocked_check_add_avx2(unsigned long long *block,
+                                          uint32_t hash,
+                                          int add)
+{
+    const __m256i salts = _mm256_loadu_si256((const __m256i *)__bloom_block_salts);
+    const __m256i one = _mm256_set1_epi64x(1);
+
+    // bit index of every word, in 32-bit lanes
+    __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)hash), salts), 26);
+    __m256i mask_lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits)));
+    __m256i mask_hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1)));
+
+    __m256i *words = (__m256i *)block;
+    __m256i lo = _mm256_load_si256(words);
+    __m256i hi = _mm256_load_si256(words + 1);
+
+    if (_mm256_testc_si256(lo, mask_lo) && _mm256_testc_si256(hi, mask_hi))
+        return 1;
+
+    if (add) {
+        _mm256_store_si256(words, _mm256_or_si256(lo, mask_lo));
+        _mm256_store_si256(words + 1, _mm256_or_si256(hi, mask_hi));
+    }
+    return 0;
+}
+#endif
+
+
+static int __bloom_blocked_check_add(struct bloom_blocked *bloom,
+                                     unsigned long long hash,
+                                     int add)
+{
+    if (!bloom->ready)
+        return -1;
+
+    unsigned int a = (unsigned int)hash;
+    unsigned int b = (unsigned int)(hash >> 32);
+    // map 'a' to [0, blocks) with a multiplication instead of a modulo
+    unsigned long long *block =
+        bloom->bf + ((((unsigned long long)a * bloom->blocks) >> 32) * BLOOM_BLOCK_WORDS);
+
+#if __BLOOM_HAVE_AVX2
+    if (bloom->avx2)
+        return __bloom_blocked_check_add_avx2(block, b, add);
+#endif
+    return __bloom_blocked_check_add_scalar(block, b, add);
+}
+
+
+int bloom_blocked_init(struct bloom_blocked *bloom, unsigned int entries, double error)
+{
+    memset(bloom, 0, sizeof(struct bloom_blocked));
+    if (entries < 1000 || error <= 0 || error >= 1)
+        return 1;
+
+    bloom->entries = entries;
+    bloom->error = error;
+
+    // start from the optimal bits per element of a plain bloom filter and
+    // add bits until the blocked layout reaches the error rate
+    bloom->bpe = -log(error) / 0.480453013918201; // ln(2)^2
+    while (__bloom_blocked_error(bloom->bpe) > error)
+        bloom->bpe += 0.25;
+
+    const long double allbits = (long double)entries * bloom->bpe;
+    bloom->blocks = (unsigned long int)(allbits / (BLOOM_BLOCK_SIZE * 8)) + 1;
+    if (bloom->blocks > UINT_MAX)
+        return 1;
+    bloom->bytes = bloom->blocks * BLOOM_BLOCK_SIZE;
+
+#ifdef _WIN32
+    bloom->bf = (unsigned long long *)_aligned_malloc(bloom->bytes, BLOOM_BLOCK_SIZE);
+#else
+    bloom->bf = (unsigned long long *)aligned_alloc(BLOOM_BLOCK_SIZE, bloom->bytes);
+#endif
+    if (bloom->bf == NULL)
+        return 1;
+    memset(bloom->bf, 0, bloom->bytes);
+
+#if __BLOOM_HAVE_AVX2
+    bloom->avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+    bloom->ready = 1;
+    return 0;
+}
+
+
+int bloom_blocked_check(struct bloom_blocked *bloom, const void *buffer, int len)
+{
+    return __bloom_blocked_check_add(bloom, bloom_hash(buffer, len), 0);
+}
+
+
+int bloom_blocked_add(struct bloom_blocked *bloom, const void *buffer, int len)
+{
+    return __bloom_blocked_check_add(bloom, bloom_hash(buffer, len), 1);
+}
+
+
+int bloom_blocked_check_hash(struct bloom_blocked *bloom, unsigned long long hash)
+{
+    return __bloom_blocked_check_add(bloom, hash, 0);
+}
+
+
+int bloom_blocked_add_hash(struct bloom_blocked *bloom, unsigned long long hash)
+{
+    return __bloom_blocked_check_add(bloom, hash, 1);
+}
+
+
+void bloom_blocked_free(struct bloom_blocked *bloom)
+{
+    if (bloom->ready) {
+#ifdef _WIN32
+        _aligned_free(bloom->bf);
+#else
+        free(bloom->bf);
+#endif
+    }
+    bloom->ready = 0;
+}
@@ -12,11 +12,18 @@
 extern "C" {
 #endif
 
-#define BLOOM_VERSION_MAJOR 3
+#define BLOOM_VERSION_MAJOR 4
 #define BLOOM_VERSION_MINOR 0
 
 #define NULL_BLOOM_FILTER { 0, 0, 0, 0, 0.0, 0, 0, 0, 0.0, NULL }
 
+#define BLOOM_SCALABLE_MAX_SLICES 32
+#define BLOOM_SCALABLE_GROWTH 2
+#define BLOOM_SCALABLE_TIGHTENING 0.8
+
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_BLOCK_WORDS 8
+
 #define ENTRIES_T unsigned int
 #define BYTES_T unsigned long int
 #define BITS_T unsigned long int
@@ -50,6 +57,69 @@ struct bloom
 };
 
 
+/** ***************************************************************************
+ * Structure to keep track of one scalable bloom filter. A scalable filter is a
+ * chain of plain bloom filters (slices). Once the newest slice holds as many
+ * elements as it was sized for (at which point about half of its bits are set)
+ * a new slice is added, BLOOM_SCALABLE_GROWTH times larger and with an error
+ * rate BLOOM_SCALABLE_TIGHTENING times smaller than the previous one. The error
+ * rates form a geometric series, so the compound false positive rate stays
+ * below the requested one while memory grows with the number of elements.
+ *
+ * See "Scalable Bloom Filters", Almeida et al., 2007.
+ *
+ */
+struct bloom_scalable
+{
+    // These fields are part of the public interface of this structure.
+    // Client code may read these values if desired. Client code MUST NOT
+    // modify any of these.
+    unsigned int entries;
+    double error;
+    unsigned long int count;
+    unsigned char slices_count;
+
+    // Fields below are private to the implementation. These may go away or
+    // change incompatibly at any moment. Client code MUST NOT access or rely
+    // on these.
+    unsigned char ready;
+    unsigned long int last_slice_count;
+    struct bloom slices[BLOOM_SCALABLE_MAX_SLICES];
+};
+
+
+/** ***************************************************************************
+ * Structure to keep track of one blocked bloom filter. The bit array is split
+ * in cache line sized blocks (BLOOM_BLOCK_SIZE bytes) and all the bits of an
+ * element are set in a single block, one bit in each of its 64-bit words. A
+ * lookup costs one cache miss instead of one per hash function, and the bit
+ * positions are computed with multiplications instead of divisions (with AVX2
+ * when the CPU supports it). Since bits are less evenly spread, more bits per
+ * element are needed for the same error rate.
+ *
+ * See "Cache-, Hash- and Space-Efficient Bloom Filters", Putze et al., 2007.
+ *
+ */
+struct bloom_blocked
+{
+    // These fields are part of the public interface of this structure.
+    // Client code may read these values if desired. Client code MUST NOT
+    // modify any of these.
+    unsigned int entries;
+    unsigned long int blocks;
+    unsigned long int bytes;
+    double error;
+    double bpe;
+
+    // Fields below are private to the implementation. These may go away or
+    // change incompatibly at any moment. Client code MUST NOT access or rely
+    // on these.
+    unsigned char ready;
+    unsigned char avx2;
+    unsigned long long * bf;
+};
+
+
 /** ***************************************************************************
  * Initialize the bloom filter for use.
  *
@@ -121,6 +191,27 @@ int bloom_check(struct bloom *bloom, const void *buffer, int len);
 int bloom_add(struct bloom *bloom, const void *buffer, int len);
 
 
+/** ***************************************************************************
+ * Compute the 64-bit hash of an element, as used by all the filters. The
+ * *_hash variants of the check and add functions take this value, so callers
+ * probing more than one filter (or checking before adding) hash only once.
+ *
+ * Any well mixed 64-bit hash may be passed to the *_hash functions instead,
+ * as long as the same function is used for all the operations on a filter.
+ *
+ */
+unsigned long long bloom_hash(const void *buffer, int len);
+
+
+/** ***************************************************************************
+ * Same as bloom_check() and bloom_add() with a precomputed hash.
+ *
+ */
+int bloom_check_hash(struct bloom *bloom, unsigned long long hash);
+
+int bloom_add_hash(struct bloom *bloom, unsigned long long hash);
+
+
 /** ***************************************************************************
  * Print (to stdout) info about this bloom filter. Debugging aid.
  *
@@ -219,6 +310,128 @@ int bloom_load(struct bloom *bloom, char *filename);
  */
 int bloom_merge(struct bloom *bloom_dest, struct bloom *bloom_src);
 
+
+/** ***************************************************************************
+ * Initialize a scalable bloom filter for use. Only the first slice is
+ * allocated here.
+ *
+ * Parameters:
+ * -----------
+ *     bloom   - Pointer to an allocated struct bloom_scalable (see above).
+ *     entries - The expected number of entries for the first slice.
+ *               Must be at least 1000.
+ *     error   - Probability of collision of the whole filter, no matter how
+ *               many slices are added.
+ *
+ * Return:
+ * -------
+ *     0 - on success
+ *     1 - on failure
+ *
+ */
+int bloom_scalable_init(struct bloom_scalable *bloom, unsigned int entries, double error);
+
+
+/** ***************************************************************************
+ * Check if the given element is in any slice of the scalable bloom filter.
+ *
+ * Return:
+ * -------
+ *     0 - element is not present
+ *     1 - element is present (or false positive due to collision)
+ *    -1 - bloom not initialized
+ *
+ */
+int bloom_scalable_check(struct bloom_scalable *bloom, const void *buffer, int len);
+
+
+/** ***************************************************************************
+ * Add the given element to the newest slice, unless it's already present in
+ * any of the slices. Adds a new slice when the newest one is full.
+ *
+ * Return:
+ * -------
+ *     0 - element was not present and was added
+ *     1 - element (or a collision) had already been added previously
+ *    -1 - bloom not initialized or a new slice could not be allocated
+ *
+ */
+int bloom_scalable_add(struct bloom_scalable *bloom, const void *buffer, int len);
+
+
+/** ***************************************************************************
+ * Same as bloom_scalable_check() and bloom_scalable_add() with a precomputed
+ * hash (see bloom_hash()). All the slices are probed with the same hash.
+ *
+ */
+int bloom_scalable_check_hash(struct bloom_scalable *bloom, unsigned long long hash);
+
+int bloom_scalable_add_hash(struct bloom_scalable *bloom, unsigned long long hash);
+
+
+/** ***************************************************************************
+ * Deallocate all the slices.
+ *
+ */
+void bloom_scalable_free(struct bloom_scalable *bloom);
+
+
+/** ***************************************************************************
+ * Initialize a blocked bloom filter for use. The number of blocks is the
+ * smallest one that keeps the false positive rate below 'error' with
+ * 'entries' elements.
+ *
+ * Return:
+ * -------
+ *     0 - on success
+ *     1 - on failure
+ *
+ */
+int bloom_blocked_init(struct bloom_blocked *bloom, unsigned int entries, double error);
+
+
+/** ***************************************************************************
+ * Check if the given element is in the blocked bloom filter.
+ *
+ * Return:
+ * -------
+ *     0 - element is not present
+ *     1 - element is present (or false positive due to collision)
+ *    -1 - bloom not initialized
+ *
+ */
+int bloom_blocked_check(struct bloom_blocked *bloom, const void *buffer, int len);
+
+
+/** ***************************************************************************
+ * Add the given element to the blocked bloom filter.
+ *
+ * Return:
+ * -------
+ *     0 - element was not present and was added
+ *     1 - element (or a collision) had already been added previously
+ *    -1 - bloom not initialized
+ *
+ */
+int bloom_blocked_add(struct bloom_blocked *bloom, const void *buffer, int len);
+
+
+/** ***************************************************************************
+ * Same as bloom_blocked_check() and bloom_blocked_add() with a precomputed
+ * hash (see bloom_hash()).
+ *
+ */
+int bloom_blocked_check_hash(struct bloom_blocked *bloom, unsigned long long hash);
+
+int bloom_blocked_add_hash(struct bloom_blocked *bloom, unsigned long long hash);
+
+
+/** ***************************************************************************
+ * Deallocate internal storage.
+ *
+ */
+void bloom_blocked_free(struct bloom_blocked *bloom);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,139 @@
+// Substring search for fixed-string patterns (-F). Candidate positions are the
+// ones where both the first and the last byte of the needle match, they're
+// found 32 (AVX2) or 16 (SSE2) positions at a time and only those are compared
+// in full. The caseless search folds ASCII letters, like PCRE2's default
+// character tables do.
+
+typedef struct {
+    // lowercased when caseless
+    uint8_t *needle;
+    size_t length;
+    int caseless, avx2;
+    uint8_t first, last;
+    // OR-ed into the input bytes before comparing with "first" and "last",
+    // 0x20 folds an ASCII letter to lowercase
+    uint8_t first_fold, last_fold;
+} Literal;
+
+static inline uint8_t literal_fold(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+static inline uint8_t literal_fold_mask(uint8_t c, int caseless) {
+    return (caseless && c >= 'a' && c <= 'z') ? 0x20 : 0;
+}
+
+// Returns 0 if memory allocation failed. "length" must not be zero.
+int literal_init(Literal *literal, const void *needle, size_t length, int caseless) {
+    size_t i;
+
+    *literal = (Literal){ .length = length, .caseless = caseless };
+    if ( !(literal->needle = malloc(length)))
+        return 0;
+    memcpy(literal->needle, needle, length);
+    if (caseless) {
+        for (i = 0; i < length; i++)
+            literal->needle[i] = literal_fold(literal->needle[i]);
+    }
+
+    literal->first = literal->needle[0];
+    literal->last = literal->needle[length - 1];
+    literal->first_fold = literal_fold_mask(literal->first, caseless);
+    literal->last_fold = literal_fold_mask(literal->last, caseless);
+#if SIMD_HAVE_AVX2
+    literal->avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+    return 1;
+}
+
+void literal_deinit(Literal *literal) {
+    free(literal->needle);
+    *literal = (Literal){ 0 };
+}
+
+static inline int literal_equal(const Literal *literal, const uint8_t *p) {
+    size_t i;
+
+    if (!literal->caseless)
+        return memcmp(p, literal->needle, literal->length) == 0;
+    for (i = 0; i < literal->length; i++) {
+        if (literal_fold(p[i]) != literal->needle[i])
+            return 0;
+    }
+    return 1;
+}
+
+#if SIMD_HAVE_AVX2
+// Candidates in [*p, end) are checked 32 at a time, *p is left at the first
+// position that wasn't checked.
+__attribute__((target("avx2")))
+static const uint8_t *literal_find_avx2(const Literal *literal, const uint8_t **p, const uint8_t *end) {
+    const __m256i first = _mm256_set1_epi8((char)literal->first);
+    const __m256i last = _mm256_set1_epi8((char)literal->last);
+    const __m256i first_fold = _mm256_set1_epi8((char)literal->first_fold);
+    const __m256i last_fold = _mm256_set1_epi8((char)literal->last_fold);
+    const uint8_t *s = *p;
+    __m256i a, b;
+    uint32_t mask;
+
+    for (; s + 32 <= end; s += 32) {
+        a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)s), first_fold);
+        b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + literal->length - 1)), last_fold);
+        mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                               _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            if (literal_equal(literal, s + simd_bit_index(mask)))
+                return s + simd_bit_index(mask);
+            mask &= mask - 1;
+        }
+    }
+    *p = s;
+    return NULL;
+}
+#endif
+
+// Find the first occurrence of the needle in [p, p + size).
+const uint8_t *literal_find(const Literal *literal, const uint8_t *p, size_t size) {
+    const uint8_t *hit;
+
+    if (size < literal->length)
+        return NULL;
+    // the last position a match can start at, plus one. Loading 16 or 32 bytes
+    // at a candidate's last byte never reads past p + size.
+    const uint8_t *end = p + size - literal->length + 1;
+
+#if SIMD_HAVE_AVX2
+    if (literal->avx2 && (hit = literal_find_avx2(literal, &p, end)))
+        return hit;
+#endif
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8((char)literal->first);
+    const __m128i last = _mm_set1_epi8((char)literal->last);
+    const __m128i first_fold = _mm_set1_epi8((char)literal->first_fold);
+    const __m128i last_fold = _mm_set1_epi8((char)literal->last_fold);
+    __m128i a, b;
+    uint32_t mask;
+
+    for (; p + SIMD_WIDTH <= end; p += SIMD_WIDTH) {
+        a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), first_fold);
+        b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + literal->length - 1)), last_fold);
+        mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                         _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            hit = p + simd_bit_index(mask);
+            if (literal_equal(literal, hit))
+                return hit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if ((p[0] | literal->first_fold) == literal->first
+            && (p[literal->length - 1] | literal->last_fold) == literal->last
+            && literal_equal(literal, p))
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
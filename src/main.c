@@ -1,51 +1,881 @@
 static const size_t ERROR_BUFFER_SIZE = 256;
+static const unsigned int DEFAULT_BLOOM_CAPACITY = 1 << 20;
+static const size_t DEFAULT_MEMORY_LIMIT = STH_BASE_GB(1);
+
+typedef struct {
+    // the pattern argument or the -e patterns, -f patterns are appended later
+    MatcherPattern *patterns;
+    size_t pattern_count;
+    const char *pattern_file, *input_path;
+    MatcherOptions matcher_options;
+    // dedup and print matches per pattern, as "pattern<TAB>match"
+    int per_pattern;
+    // dedup by the match (or its group) but print the line it's on
+    int print_line;
+    // time every pattern with both engines instead of printing matches
+    int bench_engines;
+    size_t jobs;
+    DedupMode dedup_mode;
+    unsigned int bloom_capacity;
+    // count occurrences and print them at the end instead of printing matches
+    int count, sort_by_count;
+    // print the unique matches in byte order at the end
+    int sort;
+    // with a spill directory, sorting keeps at most memory_limit bytes of
+    // unique matches in memory
+    const char *spill_dir;
+    size_t memory_limit;
+    // what is done with input that has NUL bytes
+    BinaryMode binary_mode;
+} Options;
+
+typedef struct {
+    const Options *options;
+    const MatcherPattern *patterns;
+    // what's being matched, for --print-line
+    PCRE2_SPTR subject;
+    PCRE2_SIZE subject_length;
+    Dedup dedup;
+    Spill spill;
+    sth_io_writer_t writer;
+    // fields of the key of a match: its pattern with --per-pattern, then the
+    // spans of its groups
+    HashField *fields;
+    size_t group_count;
+    // set when matching has to stop early (out of memory or a failed write)
+    int failed;
+    // the PCRE2 error that stopped matching
+    int match_error;
+    // lines skipped for going over a matching budget, by reason
+    size_t skipped_lines[MATCHER_SKIP_REASON_COUNT];
+    // in UTF mode, the offset in the input of the first invalid sequence
+    int invalid_utf;
+    size_t invalid_utf_offset;
+    // the offset in the input of the NUL byte that made it binary
+    int binary;
+    size_t binary_offset;
+} Context;
+
+// set by SIGINT and SIGTERM, matching stops and the output is flushed
+static volatile sig_atomic_t interrupted = 0;
 
 void usage(const char *program_name);
 
-int main(int argc, char *argv[]) {
-    struct bloom bloom;
-    char *subject = NULL;
-    size_t subject_length;
+// Matches are collected and printed once the input is done, instead of being
+// printed as soon as they are found.
+static inline int collects_matches(const Options *options) {
+    return options->count || options->sort;
+}
+
+// Parse a byte count with an optional K, M or G suffix.
+static int parse_size(const char *s, size_t *size_out) {
+    unsigned long long size;
+    char *end;
+
+    size = strtoull(s, &end, 10);
+    if (*s == '\0' || end == s)
+        return 0;
+    switch (*end) {
+    case 'G': case 'g':
+        size <<= 10;
+        // fallthrough
+    case 'M': case 'm':
+        size <<= 10;
+        // fallthrough
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+    if (*end != '\0' || size > SIZE_MAX)
+        return 0;
+    *size_out = (size_t)size;
+    return 1;
+}
+
+static int parse_options(int argc, char *argv[], Options *options) {
+    static const struct option long_options[] = {
+        { "fixed-strings", no_argument, NULL, 'F' },
+        { "case-sensitive", no_argument, NULL, 's' },
+        { "ignore-case", no_argument, NULL, 'i' },
+        { "utf", no_argument, NULL, 'u' },
+        { "dotall", no_argument, NULL, 'D' },
+        { "line-regexp", no_argument, NULL, 'x' },
+        { "word-regexp", no_argument, NULL, 'w' },
+        { "no-capture", no_argument, NULL, 'n' },
+        { "only-group", required_argument, NULL, 'o' },
+        { "print-line", no_argument, NULL, 'p' },
+        { "pattern-cache", required_argument, NULL, 'K' },
+        { "engine", required_argument, NULL, 'E' },
+        { "bench-engines", no_argument, NULL, 'B' },
+        { "match-limit", required_argument, NULL, 'L' },
+        { "depth-limit", required_argument, NULL, 'R' },
+        { "heap-limit", required_argument, NULL, 'H' },
+        { "regexp", required_argument, NULL, 'e' },
+        { "file", required_argument, NULL, 'f' },
+        { "per-pattern", no_argument, NULL, 'P' },
+        { "jobs",  required_argument, NULL, 'j' },
+        { "dedup", required_argument, NULL, 'd' },
+        { "bloom-capacity", required_argument, NULL, 'C' },
+        { "count", no_argument, NULL, 'c' },
+        { "sort-count", no_argument, NULL, 'N' },
+        { "sort", no_argument, NULL, 'S' },
+        { "spill-dir", required_argument, NULL, 'T' },
+        { "memory-limit", required_argument, NULL, 'M' },
+        { "binary", required_argument, NULL, 'b' },
+        { "help",  no_argument,       NULL, 'h' },
+        { 0 },
+    };
+    unsigned long capacity, limit;
+    size_t i, heap_limit;
+    char *end;
+    int opt;
+
+    *options = (Options){
+        .matcher_options = {
+            .engine = MATCHER_ENGINE_PCRE2,
+            .caseless = 1,
+        },
+        .patterns = calloc(argc, sizeof(*options->patterns)),
+        .jobs = 1,
+        .dedup_mode = DEDUP_BLOOM,
+        .bloom_capacity = DEFAULT_BLOOM_CAPACITY,
+        .memory_limit = DEFAULT_MEMORY_LIMIT,
+        .binary_mode = BINARY_SKIP,
+    };
+    if (!options->patterns)
+        return 0;
+    while ((opt = getopt_long(argc, argv, "Fsiuxwo:e:f:j:d:cSh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'F':
+            options->matcher_options.engine = MATCHER_ENGINE_LITERAL;
+            break;
+        case 's':
+            options->matcher_options.caseless = 0;
+            break;
+        case 'i':
+            options->matcher_options.caseless = 1;
+            break;
+        case 'u':
+            options->matcher_options.utf = 1;
+            break;
+        case 'D':
+            options->matcher_options.dotall = 1;
+            break;
+        case 'x':
+            options->matcher_options.line = 1;
+            break;
+        case 'w':
+            options->matcher_options.word = 1;
+            break;
+        case 'n':
+            options->matcher_options.no_capture = 1;
+            break;
+        case 'o':
+            options->matcher_options.groups = optarg;
+            break;
+        case 'p':
+            options->print_line = 1;
+            break;
+        case 'K':
+            options->matcher_options.cache_dir = optarg;
+            break;
+        case 'E':
+            if (strcmp(optarg, "backtrack") == 0) {
+                options->matcher_options.dfa = 0;
+            } else if (strcmp(optarg, "dfa") == 0) {
+                options->matcher_options.dfa = 1;
+            } else {
+                fprintf(stderr, "invalid engine: \'%s\'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'B':
+            options->bench_engines = 1;
+            break;
+        case 'L':
+        case 'R':
+            limit = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || limit == 0 || limit > UINT32_MAX) {
+                fprintf(stderr, "invalid %s limit: \'%s\'\n", (opt == 'L') ? "match" : "depth", optarg);
+                return 0;
+            }
+            if (opt == 'L')
+                options->matcher_options.match_limit = (uint32_t)limit;
+            else
+                options->matcher_options.depth_limit = (uint32_t)limit;
+            break;
+        case 'H':
+            // PCRE2 counts the heap limit in KB
+            if (!parse_size(optarg, &heap_limit) || heap_limit == 0
+                || (heap_limit + 1023) / 1024 > UINT32_MAX)
+            {
+                fprintf(stderr, "invalid heap limit: \'%s\'\n", optarg);
+                return 0;
+            }
+            options->matcher_options.heap_limit = (uint32_t)((heap_limit + 1023) / 1024);
+            break;
+        case 'e':
+            options->patterns[options->pattern_count++] = (MatcherPattern){
+                .data = optarg,
+                .length = strlen(optarg),
+            };
+            break;
+        case 'f':
+            options->pattern_file = optarg;
+            break;
+        case 'P':
+            options->per_pattern = 1;
+            break;
+        case 'j':
+            errno = 0;
+            options->jobs = strtoul(optarg, &end, 10);
+            // strtoul negates "-1" into ULONG_MAX, only digits are taken
+            if (*optarg < '0' || *optarg > '9' || *end != '\0' || errno == ERANGE || options->jobs < 1) {
+                fprintf(stderr, "invalid number of jobs: \'%s\'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'd':
+            if (!dedup_mode_from_name(optarg, &options->dedup_mode)) {
+                fprintf(stderr, "invalid dedup mode: \'%s\'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'C':
+            capacity = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || capacity < 1000 || capacity > UINT_MAX) {
+                fprintf(stderr, "invalid bloom filter capacity: \'%s\'\n", optarg);
+                return 0;
+            }
+            options->bloom_capacity = (unsigned int)capacity;
+            break;
+        case 'c':
+            options->count = 1;
+            break;
+        case 'N':
+            options->count = 1;
+            options->sort_by_count = 1;
+            break;
+        case 'S':
+            options->sort = 1;
+            break;
+        case 'T':
+            options->spill_dir = optarg;
+            options->sort = 1;
+            break;
+        case 'M':
+            if (!parse_size(optarg, &options->memory_limit) || options->memory_limit < SPILL_MIN_MEMORY_LIMIT) {
+                fprintf(stderr, "invalid memory limit: \'%s\'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'b':
+            if (!binary_mode_from_name(optarg, &options->binary_mode)) {
+                fprintf(stderr, "invalid binary mode: \'%s\'\n", optarg);
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    // spilled runs are merged in byte order, they can't be ordered by count
+    if (options->spill_dir && options->sort_by_count) {
+        fprintf(stderr, "--sort-count can't be used with --spill-dir\n");
+        return 0;
+    }
+
+    // the DFA has no captures, all of its groups would be empty
+    if (options->matcher_options.dfa && options->matcher_options.groups) {
+        fprintf(stderr, "--only-group can't be used with --engine dfa\n");
+        return 0;
+    }
+
+    // collected matches are printed from the dedup set, which only has keys
+    if (options->print_line && collects_matches(options)) {
+        fprintf(stderr, "--print-line can't be used with --count or --sort\n");
+        return 0;
+    }
+
+    // counting and sorting need every key, only the exact mode keeps them
+    if (collects_matches(options))
+        options->dedup_mode = DEDUP_EXACT;
+
+    // with -e or -f patterns, the only argument is the input
+    if (options->pattern_count == 0 && !options->pattern_file) {
+        if (optind == argc)
+            return 0;
+        options->patterns[options->pattern_count++] = (MatcherPattern){
+            .data = argv[optind],
+            .length = strlen(argv[optind]),
+        };
+        optind++;
+    }
+    if (argc - optind > 1)
+        return 0;
+    // an empty string would match everywhere without ever advancing
+    for (i = 0; i < options->pattern_count; i++) {
+        if (options->matcher_options.engine == MATCHER_ENGINE_LITERAL && options->patterns[i].length == 0) {
+            fprintf(stderr, "empty fixed string pattern\n");
+            return 0;
+        }
+    }
+    // several -e patterns are extractions of their own
+    if (options->pattern_count > 1)
+        options->per_pattern = 1;
+    options->input_path = (optind < argc) ? argv[optind] : "-";
+    return 1;
+}
+
+// Split the pattern file into lines, skipping empty ones, and append them to
+// the patterns of "options". The patterns point into "view". Returns 0 (with a
+// message) if there are none or the file can't be read.
+static int load_patterns(Options *options, sth_io_file_view_t *view) {
+    const char *path = options->pattern_file, *line, *end, *newline;
+    MatcherPattern *patterns;
+    size_t count = options->pattern_count, length;
+
+    if (!sth_io_file_view_open(path, view)) {
+        fprintf(stderr, "failed to read \'%s\' file\n", path);
+        return 0;
+    }
+
+    // at most one pattern per newline, plus an unterminated last line
+    patterns = realloc(options->patterns, (count + view->size / 2 + 1) * sizeof(*patterns));
+    if (!patterns) {
+        fprintf(stderr, "failed to allocate patterns\n");
+        return 0;
+    }
+    options->patterns = patterns;
+
+    end = view->data + view->size;
+    for (line = view->data; line < end; line = newline + 1) {
+        if ( !(newline = memchr(line, '\n', (size_t)(end - line))))
+            newline = end;
+        length = (size_t)(newline - line);
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+        if (length > 0)
+            patterns[count++] = (MatcherPattern){ .data = line, .length = length };
+    }
+
+    if (count == options->pattern_count) {
+        fprintf(stderr, "no patterns in \'%s\'\n", path);
+        return 0;
+    }
+    options->pattern_count = count;
+    return 1;
+}
+
+static void on_interrupt(int signum) {
+    (void)signum;
+    interrupted = 1;
+}
+
+static void install_signal_handlers(void) {
+    struct sigaction action = { 0 };
+
+    // a closed output is reported by the writer as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    action.sa_handler = on_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+static inline int should_stop(const Context *ctx) {
+    return ctx->failed || ctx->match_error || interrupted;
+}
+
+// Get the next chunk of stdin. A read interrupted by SIGINT or SIGTERM isn't
+// retried, so they stop the program while it waits for input.
+static int next_chunk(sth_io_reader_t *reader, char **chunk_out, size_t *size_out) {
+    for (;;) {
+        if (sth_io_reader_next(reader, chunk_out, size_out))
+            return 1;
+        if (reader->eof || errno != EINTR || interrupted)
+            return 0;
+    }
+}
+
+// Print the line of a unique match, labelled with its pattern like the keys of
+// --per-pattern.
+static int print_match_line(Context *ctx, const ParallelMatch *match) {
+    const MatcherPattern *pattern = &ctx->patterns[match->pattern_index];
+    PCRE2_SPTR line;
+    PCRE2_SIZE line_length;
+
+    matcher_line_bounds(ctx->subject, ctx->subject_length, match->match_start, match->match_end,
+                        &line, &line_length);
+    if (ctx->options->per_pattern
+        && (!sth_io_writer_write_ref(&ctx->writer, pattern->data, pattern->length)
+            || !sth_io_writer_write(&ctx->writer, "\t", 1)))
+    {
+        return 0;
+    }
+    return sth_io_writer_write_ref(&ctx->writer, line, line_length)
+           && sth_io_writer_write(&ctx->writer, "\n", 1);
+}
+
+// Print the fields of a key separated by tabs, the way the exact set stores it.
+static int print_fields(Context *ctx, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if ((i > 0 && !sth_io_writer_write(&ctx->writer, "\t", 1))
+            || !sth_io_writer_write_ref(&ctx->writer, ctx->fields[i].data, ctx->fields[i].length))
+        {
+            return 0;
+        }
+    }
+    return sth_io_writer_write(&ctx->writer, "\n", 1);
+}
+
+// The key of a match is the tuple of its groups, with its pattern in front of
+// them with --per-pattern so equal matches of different patterns are different
+// keys. Matches are referenced in-place by the writer, so they must stay valid
+// until the writer is flushed. Collected matches are only stored (and
+// counted).
+static void print_if_unique(Context *ctx, const ParallelMatch *match) {
+    const MatcherPattern *pattern = &ctx->patterns[match->pattern_index];
+    size_t count = 0, i;
+    int res;
+
+    if (ctx->options->per_pattern)
+        ctx->fields[count++] = (HashField){ .data = pattern->data, .length = pattern->length };
+    for (i = 0; i < ctx->group_count; i++)
+        ctx->fields[count++] = (HashField){ .data = match->spans[i].start, .length = match->spans[i].length };
+
+    res = dedup_insert(&ctx->dedup, ctx->fields, count);
+    if (res > 0 && ctx->options->print_line) {
+        if (!print_match_line(ctx, match))
+            ctx->failed = 1;
+    } else if (res > 0 && !collects_matches(ctx->options)) {
+        if (!print_fields(ctx, count))
+            ctx->failed = 1;
+    } else if (res > 0 && ctx->options->spill_dir && spill_over_limit(&ctx->spill, &ctx->dedup.set)) {
+        if (!spill_write_run(&ctx->spill, &ctx->dedup.set, ctx->options->jobs))
+            ctx->failed = 1;
+    } else if (res < 0) {
+        ctx->failed = 1;
+    }
+}
+
+// In UTF mode, validate the matcher's subject, which starts at "input_offset"
+// in the input, before it's matched. Returns 0, with the error as the match
+// error, if compiling the patterns for invalid UTF-8 failed.
+static int check_utf(Context *ctx, Matcher *matcher, size_t input_offset) {
+    PCRE2_SIZE invalid_offset;
+    const int ok = matcher_check_utf(matcher, &ctx->options->matcher_options, &invalid_offset);
+
+    if (invalid_offset < ctx->subject_length && !ctx->invalid_utf) {
+        ctx->invalid_utf = 1;
+        ctx->invalid_utf_offset = input_offset + invalid_offset;
+    }
+    if (!ok)
+        ctx->match_error = matcher->error_code;
+    return ok;
+}
+
+// Leave the binary data of a subject that starts at "input_offset" in the input
+// out of *size. Once the input is found binary, the rest of it isn't matched.
+static void check_binary(Context *ctx, PCRE2_SPTR subject, size_t *size, size_t input_offset) {
+    size_t nul_offset;
+
+    if (!binary_check(ctx->options->binary_mode, subject, size, input_offset, &nul_offset)) {
+        ctx->binary = 1;
+        ctx->binary_offset = nul_offset;
+    }
+}
+
+static void print_unique_matches(Context *ctx, Matcher *matcher) {
     PCRE2_SPTR substring_start;
     PCRE2_SIZE substring_length;
+    ParallelMatch match;
+
+    while (!should_stop(ctx) && matcher_next(matcher, &substring_start, &substring_length)) {
+        match = (ParallelMatch){ .spans = matcher->spans, .pattern_index = matcher->pattern_index };
+        matcher_match_offsets(matcher, &match.match_start, &match.match_end);
+        print_if_unique(ctx, &match);
+    }
+    ctx->match_error = matcher->match_error;
+}
+
+static int print_unique_batch(void *sink_data, const ParallelMatch *matches, size_t count) {
+    Context *ctx = sink_data;
+    size_t i;
+
+    for (i = 0; i < count && !should_stop(ctx); i++)
+        print_if_unique(ctx, &matches[i]);
+    return !should_stop(ctx);
+}
+
+// Higher counts first, ties in byte order of the keys.
+static int compare_by_count(const void *a, const void *b) {
+    const StringSetEntry *x = *(const StringSetEntry * const *)a;
+    const StringSetEntry *y = *(const StringSetEntry * const *)b;
+    int res;
+
+    if (x->count != y->count)
+        return (x->count < y->count) ? 1 : -1;
+    res = memcmp(x->key, y->key, (x->length < y->length) ? x->length : y->length);
+    if (res != 0)
+        return res;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+// Print the collected unique matches, prefixed with "count<TAB>" in count
+// mode. They're sorted by count, in byte order or left in table order.
+static int print_collected(Context *ctx) {
+    const Options *options = ctx->options;
+    const StringSet *set = &ctx->dedup.set;
+    StringSetEntry **entries;
+    char count_buffer[32];
+    int count_length;
+    size_t i;
+
+    if (ctx->spill.run_count > 0)
+        return spill_merge(&ctx->spill, set, options->jobs, &ctx->writer, options->count, &interrupted);
+
+    if ( !(entries = string_set_entries(set)))
+        return 0;
+    if (options->sort_by_count) {
+        qsort(entries, set->count, sizeof(*entries), compare_by_count);
+    } else if (options->sort && !sort_entries(entries, set->count, options->jobs)) {
+        free(entries);
+        return 0;
+    }
+
+    for (i = 0; i < set->count && !interrupted; i++) {
+        if (options->count) {
+            count_length = snprintf(count_buffer, sizeof(count_buffer), "%zu\t", entries[i]->count);
+            if (!sth_io_writer_write(&ctx->writer, count_buffer, count_length))
+                break;
+        }
+        if (!sth_io_writer_write_ref(&ctx->writer, entries[i]->key, entries[i]->length)
+            || !sth_io_writer_write(&ctx->writer, "\n", 1))
+        {
+            break;
+        }
+    }
+
+    free(entries);
+    return 1;
+}
+
+// Tell how many lines weren't matched because they went over a budget.
+static void report_skipped_lines(const size_t *skipped_lines) {
+    size_t total = 0, i;
+    const char *separator = "";
+
+    for (i = 0; i < MATCHER_SKIP_REASON_COUNT; i++)
+        total += skipped_lines[i];
+    if (total == 0)
+        return;
+
+    fprintf(stderr, "skipped %zu line%s over the matching limits (", total, (total == 1) ? "" : "s");
+    for (i = 0; i < MATCHER_SKIP_REASON_COUNT; i++) {
+        if (skipped_lines[i]) {
+            fprintf(stderr, "%s%s: %zu", separator, MATCHER_SKIP_REASON_NAMES[i], skipped_lines[i]);
+            separator = ", ";
+        }
+    }
+    fprintf(stderr, ")\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    Context ctx = { .options = &options };
+    sth_io_file_view_t input = { 0 }, pattern_file = { 0 };
+    sth_io_reader_t reader = { 0 };
+    char *chunk;
+    size_t chunk_size, input_offset = 0;
     PCRE2_UCHAR error_buffer[ERROR_BUFFER_SIZE];
 
-    if (argc != 3) {
+    if (!parse_options(argc, argv, &options)) {
         usage(argv[0]);
         return 1;
     }
 
-    const PCRE2_SPTR pattern = (PCRE2_SPTR)argv[1];
-    if (! (subject = sth_io_file_read_all(argv[2], &subject_length))) {
-        fprintf(stderr, "failed to read \'%s\' file\n", argv[2]);
+    if (options.pattern_file && !load_patterns(&options, &pattern_file))
+        return 1;
+    const MatcherPattern *patterns = options.patterns;
+    const size_t pattern_count = options.pattern_count;
+    ctx.patterns = patterns;
+
+    // without a file (or with "-") the input is streamed from stdin
+    const int streaming = (strcmp(options.input_path, "-") == 0);
+
+    if (streaming) {
+        if (!sth_io_reader_init(&reader, STDIN_FILENO, STH_IO_READER_DEFAULT_CHUNK_SIZE)) {
+            fprintf(stderr, "failed to allocate input buffer\n");
+            return 1;
+        }
+    } else if (!sth_io_file_view_open(options.input_path, &input)) {
+        fprintf(stderr, "failed to read \'%s\' file\n", options.input_path);
+        return 1;
+    }
+
+    // the matcher scans the file's pages in-place, an empty file has no pages
+    const PCRE2_SPTR subject = (input.size) ? (PCRE2_SPTR)input.data : (PCRE2_SPTR)"";
+    // with --binary skip or stop, what's left of it once binary data is left out
+    size_t subject_length = input.size;
+    if (!streaming)
+        check_binary(&ctx, subject, &subject_length, 0);
+    ctx.subject = subject;
+    ctx.subject_length = subject_length;
+
+    if (options.bench_engines) {
+        if (streaming) {
+            fprintf(stderr, "--bench-engines needs an input file\n");
+            return 1;
+        }
+        const int ok = bench_engines(patterns, pattern_count, &options.matcher_options, subject, subject_length);
+        sth_io_file_view_close(&input);
+        free(options.patterns);
+        if (options.pattern_file)
+            sth_io_file_view_close(&pattern_file);
+        return ok ? 0 : 1;
+    }
+
+    // PCRE2 memory of the matcher, worker threads have allocators of their own
+    Allocator allocator;
+    if (!allocator_init(&allocator)) {
+        fprintf(stderr, "failed to initialize matcher allocator\n");
         return 1;
     }
+    options.matcher_options.general_context = allocator.context;
 
     Matcher matcher = { 0 };
-    if (!matcher_init(&matcher, pattern, subject, subject_length)) {
+    if (!matcher_init(&matcher, patterns, pattern_count, &options.matcher_options, subject, subject_length)) {
         matcher_error_info(&matcher, error_buffer, sizeof(error_buffer));
-        fprintf(stderr, "failed to initialize matcher (%d): error at offset %zu: %s\n",
-                matcher.error_code, matcher.error_offset, error_buffer);
+        if (matcher.error_code == PCRE2_ERROR_NOSUBSTRING || matcher.error_code == PCRE2_ERROR_NOUNIQUESUBSTRING) {
+            fprintf(stderr, "failed to initialize matcher: pattern \'%.*s\' doesn't have capture groups \'%s\'\n",
+                    (int)patterns[matcher.error_pattern].length, patterns[matcher.error_pattern].data,
+                    options.matcher_options.groups);
+        } else if (pattern_count > 1) {
+            fprintf(stderr, "failed to initialize matcher (%d): error in pattern \'%.*s\' at offset %zu: %s\n",
+                    matcher.error_code, (int)patterns[matcher.error_pattern].length,
+                    patterns[matcher.error_pattern].data, matcher.error_offset, error_buffer);
+        } else {
+            fprintf(stderr, "failed to initialize matcher (%d): error at offset %zu: %s\n",
+                    matcher.error_code, matcher.error_offset, error_buffer);
+        }
         return 1;
     }
 
-    if (bloom_init(&bloom, (1<<20), 0.01f)) {
-        fprintf(stderr, "failed to initialize bloom filter\n");
+    ctx.group_count = matcher.group_count;
+    if ( !(ctx.fields = calloc(ctx.group_count + 1, sizeof(*ctx.fields)))) {
+        fprintf(stderr, "failed to allocate match keys\n");
         return 1;
     }
 
-    while (matcher_next(&matcher, &substring_start, &substring_length)) {
-        // filter unique matches with bloom filter
-        if (!bloom_check(&bloom, substring_start, (int)substring_length)) {
-            bloom_add(&bloom, substring_start, (int)substring_length);
-            printf("%.*s\n", (int)substring_length, (char*)substring_start);
+    if (!dedup_init(&ctx.dedup, options.dedup_mode, options.bloom_capacity)) {
+        fprintf(stderr, "failed to initialize dedup filter\n");
+        return 1;
+    }
+
+    spill_init(&ctx.spill, options.spill_dir, options.memory_limit);
+
+    if (!sth_io_writer_init(&ctx.writer, STDOUT_FILENO, STH_IO_WRITER_DEFAULT_BUFFER_SIZE)) {
+        fprintf(stderr, "failed to allocate output buffer\n");
+        return 1;
+    }
+
+    install_signal_handlers();
+
+    // chunks end at line boundaries, a match across lines needs the whole input
+    if (streaming && !matcher.line_local)
+        reader.chunk_size = SIZE_MAX;
+
+    if (streaming) {
+        while (!should_stop(&ctx) && !ctx.binary && next_chunk(&reader, &chunk, &chunk_size)) {
+            check_binary(&ctx, (PCRE2_SPTR)chunk, &chunk_size, input_offset);
+            matcher_set_subject(&matcher, (PCRE2_SPTR)chunk, chunk_size);
+            ctx.subject = (PCRE2_SPTR)chunk;
+            ctx.subject_length = chunk_size;
+            if (!check_utf(&ctx, &matcher, input_offset))
+                break;
+            input_offset += chunk_size;
+            if (chunk_size > 0)
+                print_unique_matches(&ctx, &matcher);
+            // the next read reuses the chunk that queued matches point to
+            if (!sth_io_writer_flush(&ctx.writer))
+                ctx.failed = 1;
+        }
+        if (!should_stop(&ctx) && !ctx.binary && !reader.eof) {
+            fprintf(stderr, "failed to read from stdin: %s\n", strerror(errno));
+            return 1;
         }
+        sth_io_reader_deinit(&reader);
+    } else if (!check_utf(&ctx, &matcher, 0)) {
+        // reported as the match error
+    } else if (ctx.binary && subject_length == 0) {
+        // skipped
+    } else if (options.jobs > 1 && matcher.line_local) {
+        // chunks end at line boundaries, a match across lines is matched serially
+        if (!parallel_scan(&matcher, subject, subject_length, options.jobs, print_unique_batch, &ctx,
+                           &ctx.match_error, ctx.skipped_lines))
+        {
+            fprintf(stderr, "failed to start worker threads\n");
+            return 1;
+        }
+    } else {
+        print_unique_matches(&ctx, &matcher);
     }
 
+    if (collects_matches(&options) && !should_stop(&ctx) && !print_collected(&ctx))
+        ctx.failed = 1;
+
+    // flush before the input is unmapped, queued matches point into it
+    sth_io_writer_flush(&ctx.writer);
+    if (!streaming)
+        sth_io_file_view_close(&input);
+
+    matcher_add_skipped_lines(&matcher, ctx.skipped_lines);
     matcher_deinit(&matcher);
+    allocator_deinit(&allocator);
+    free(options.patterns);
+    if (options.pattern_file)
+        sth_io_file_view_close(&pattern_file);
+    free(ctx.fields);
+    dedup_deinit(&ctx.dedup);
+    spill_deinit(&ctx.spill);
+    sth_io_writer_deinit(&ctx.writer);
+
+    if (ctx.writer.error) {
+        // the reader of our output is gone, that's not an error
+        if (ctx.writer.error == EPIPE)
+            return 0;
+        fprintf(stderr, "failed to write output: %s\n", strerror(ctx.writer.error));
+        return 1;
+    }
+    report_skipped_lines(ctx.skipped_lines);
+    const char *quote = streaming ? "" : "\'";
+    const char *input_name = streaming ? "standard input" : options.input_path;
+    if (ctx.binary && options.binary_mode == BINARY_SKIP) {
+        fprintf(stderr, "%s%s%s is binary (NUL byte at offset %zu), skipped\n",
+                quote, input_name, quote, ctx.binary_offset);
+    } else if (ctx.binary) {
+        fprintf(stderr, "%s%s%s is binary from offset %zu on, matched up to the line of its NUL byte\n",
+                quote, input_name, quote, ctx.binary_offset);
+    }
+    if (ctx.invalid_utf) {
+        fprintf(stderr, "input is not valid UTF-8, first invalid byte at offset %zu\n", ctx.invalid_utf_offset);
+    }
+    if (ctx.match_error) {
+        pcre2_get_error_message(ctx.match_error, error_buffer, sizeof(error_buffer));
+        fprintf(stderr, "matching failed (%d): %s\n", ctx.match_error, error_buffer);
+        return 1;
+    }
+    if (ctx.spill.error) {
+        fprintf(stderr, "failed to spill unique matches to \'%s\': %s\n",
+                options.spill_dir, strerror(ctx.spill.error));
+        return 1;
+    }
+    if (ctx.failed) {
+        fprintf(stderr, "out of memory while storing unique matches\n");
+        return 1;
+    }
+    if (interrupted)
+        return 130;
     return 0;
 }
 
 void usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s <pattern> <file>\n", program_name);
+    fprintf(stderr,
+            "Usage: %s [options] <pattern> [file]\n"
+            "       %s [options] (-e <pattern> | -f <patterns>)... [file]\n"
+            "\n"
+            "With no file, or when file is -, read standard input as a stream.\n"
+            "\n"
+            "Options:\n"
+            "  -F, --fixed-strings the pattern is a plain string, searched without the\n"
+            "                      regex engine\n"
+            "  -s, --case-sensitive\n"
+            "                      match case, matching is caseless by default. Case\n"
+            "                      sensitive patterns match much faster\n"
+            "  -i, --ignore-case   ignore case (default)\n"
+            "  -u, --utf           match UTF-8 characters instead of bytes, with Unicode\n"
+            "                      case folding. The input is validated once, invalid\n"
+            "                      UTF-8 is reported on stderr and never matches (the\n"
+            "                      dfa engine stops there)\n"
+            "      --dotall        the dot matches newlines too\n"
+            "  -x, --line-regexp   only match whole lines\n"
+            "  -w, --word-regexp   only match whole words\n"
+            "      --no-capture    plain parentheses don't capture, like (?:...)\n"
+            "  -o, --only-group GROUP[,GROUP]...\n"
+            "                      extract capture groups, by number or name, instead of\n"
+            "                      the whole match. Several groups make a tuple, deduped\n"
+            "                      as a whole and printed tab separated. Groups that\n"
+            "                      didn't match are empty, matches without any of them\n"
+            "                      are skipped\n"
+            "      --print-line    dedup by the match (or its group) but print the whole\n"
+            "                      line of its first occurrence\n"
+            "      --pattern-cache DIR\n"
+            "                      keep compiled patterns in DIR and reuse them on the\n"
+            "                      next runs instead of compiling them again\n"
+            "      --engine NAME   how patterns are matched:\n"
+            "                        backtrack  pcre2_match, JIT compiled (default)\n"
+            "                        dfa        pcre2_dfa_match, time linear in the input\n"
+            "                                   and the longest match at each position.\n"
+            "                                   No back references or capture groups\n"
+            "      --match-limit N how many times PCRE2 may backtrack (or the DFA may\n"
+            "                      step) in a single match, lines that need more are\n"
+            "                      skipped and counted on stderr (default: PCRE2's,\n"
+            "                      usually 10000000)\n"
+            "      --depth-limit N how deep PCRE2 may backtrack (or the DFA may recurse),\n"
+            "                      like --match-limit\n"
+            "      --heap-limit SIZE\n"
+            "                      heap PCRE2 may use for backtracking in a single match,\n"
+            "                      with an optional K, M or G suffix, like --match-limit\n"
+            "                      (default: PCRE2's, usually 20G). The JIT stack grows\n"
+            "                      up to 64M as needed\n"
+            "      --bench-engines time every pattern over the input file with both\n"
+            "                      engines and print \"engine<TAB>matches<TAB>seconds\n"
+            "                      <TAB>MB/s<TAB>pattern\" rows instead of matches\n"
+            "  -e, --regexp PATTERN\n"
+            "                      add a pattern, can be repeated. All the patterns are\n"
+            "                      matched in a single pass and two or more of them imply\n"
+            "                      --per-pattern\n"
+            "  -f, --file FILE     match every pattern of FILE, one per line, in a single\n"
+            "                      pass. A set of fixed strings (with -F or without regex\n"
+            "                      metacharacters) is matched with an Aho-Corasick\n"
+            "                      automaton and overlapping matches of different\n"
+            "                      strings are all reported\n"
+            "      --per-pattern   dedup matches per pattern, printed as\n"
+            "                      \"pattern<TAB>match\"\n"
+            "  -j, --jobs N        match a file with N threads (at least 1). Output\n"
+            "                      order is not deterministic with more than one job.\n"
+            "                      Patterns that may match across lines use one thread\n"
+            "  -d, --dedup MODE    how unique matches are detected:\n"
+            "                        bloom    scalable bloom filter, little memory but may\n"
+            "                                 drop unique matches on false positives (default)\n"
+            "                        blocked  cache line blocked bloom filter, fastest but\n"
+            "                                 sized up-front by --bloom-capacity\n"
+            "                        exact    keep a copy of every unique match\n"
+            "      --bloom-capacity N\n"
+            "                      expected number of unique matches (default: 1048576)\n"
+            "  -c, --count         print \"count<TAB>match\" for every unique match once the\n"
+            "                      input is done, in no particular order (implies -d exact)\n"
+            "      --sort-count    like --count, sorted by descending count\n"
+            "  -S, --sort          print unique matches in byte order once the input is\n"
+            "                      done, like LC_ALL=C sort -u (implies -d exact). Uses\n"
+            "                      --jobs threads for big sets\n"
+            "      --spill-dir DIR like --sort, but when the unique matches go over\n"
+            "                      --memory-limit they're written to sorted runs in DIR\n"
+            "                      and merged at the end\n"
+            "      --memory-limit SIZE\n"
+            "                      memory for unique matches with --spill-dir, with an\n"
+            "                      optional K, M or G suffix (default: 1G)\n"
+            "      --binary MODE   what is done with binary input, which has NUL bytes:\n"
+            "                        skip  don't match input with a NUL byte in its\n"
+            "                              first 32K (default)\n"
+            "                        text  match it like text\n"
+            "                        stop  match up to the line of the first NUL byte\n"
+            "  -h, --help          show this help\n",
+            program_name, program_name);
 }
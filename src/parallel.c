@@ -0,0 +1,200 @@
+// Workers take chunks of this size from a shared counter, so a slow chunk
+// (e.g. one with a lot of matches) doesn't leave the other threads idle.
+static const size_t PARALLEL_CHUNK_SIZE = 4 * 1024 * 1024;
+// Matches are handed to the sink in batches to keep lock contention low.
+#define PARALLEL_BATCH_SIZE 256
+
+typedef struct {
+    // the spans of the extracted groups, the whole match by default
+    const MatcherSpan *spans;
+    size_t pattern_index;
+    // offsets of the whole match in the subject
+    PCRE2_SIZE match_start, match_end;
+} ParallelMatch;
+
+// Called with the shared lock held, so the sink doesn't need to be thread-safe.
+// Returning 0 stops all the workers.
+typedef int (*ParallelSink)(void *sink_data, const ParallelMatch *matches, size_t count);
+
+typedef struct {
+    const Matcher *source;
+    PCRE2_SPTR subject;
+    PCRE2_SIZE subject_length;
+    size_t chunk_count;
+    atomic_size_t next_chunk;
+    atomic_int stop;
+    // the first error that stopped a worker's matching
+    atomic_int match_error;
+    pthread_mutex_t lock;
+    // lines the workers skipped for going over a budget, under the lock
+    size_t skipped_lines[MATCHER_SKIP_REASON_COUNT];
+    ParallelSink sink;
+    void *sink_data;
+} ParallelScan;
+
+typedef struct {
+    ParallelScan *scan;
+    // the worker's matcher allocates from its own allocator
+    Allocator allocator;
+    Matcher matcher;
+    ParallelMatch batch[PARALLEL_BATCH_SIZE];
+    // group_count spans for every match of the batch
+    MatcherSpan *spans;
+    size_t batch_count;
+    // set if the worker couldn't create its matcher
+    int failed;
+} ParallelWorker;
+
+// Move "offset" forward to the start of the next line, so every chunk consists
+// of whole lines. Both neighbouring chunks compute the same boundary.
+static PCRE2_SIZE parallel_chunk_boundary(const ParallelScan *scan, PCRE2_SIZE offset) {
+    const void *newline;
+
+    if (offset == 0 || offset >= scan->subject_length)
+        return (offset == 0) ? 0 : scan->subject_length;
+    if (scan->subject[offset - 1] == '\n')
+        return offset;
+
+    newline = memchr(scan->subject + offset, '\n', scan->subject_length - offset);
+    if (!newline)
+        return scan->subject_length;
+    return (PCRE2_SIZE)((PCRE2_SPTR)newline - scan->subject) + 1;
+}
+
+static void parallel_worker_flush(ParallelWorker *worker) {
+    ParallelScan *scan = worker->scan;
+
+    if (worker->batch_count == 0)
+        return;
+    pthread_mutex_lock(&scan->lock);
+    if (!atomic_load(&scan->stop) && !scan->sink(scan->sink_data, worker->batch, worker->batch_count))
+        atomic_store(&scan->stop, 1);
+    pthread_mutex_unlock(&scan->lock);
+    worker->batch_count = 0;
+}
+
+static void *parallel_worker_run(void *arg) {
+    ParallelWorker *worker = arg;
+    ParallelScan *scan = worker->scan;
+    Matcher *matcher = &worker->matcher;
+    PCRE2_SPTR substring_start;
+    PCRE2_SIZE substring_length, start, end;
+    MatcherSpan *spans;
+    ParallelMatch *match;
+    size_t chunk;
+
+    if (!allocator_init(&worker->allocator)
+        || !matcher_init_shared(matcher, scan->source, worker->allocator.context))
+    {
+        worker->failed = 1;
+        goto ret;
+    }
+
+    matcher_set_subject(matcher, scan->subject, scan->subject_length);
+    // the subject is the one the source matcher checked for valid UTF-8
+    matcher->utf_checked = scan->source->utf_checked;
+    while (!atomic_load(&scan->stop)
+           && (chunk = atomic_fetch_add(&scan->next_chunk, 1)) < scan->chunk_count)
+    {
+        start = parallel_chunk_boundary(scan, chunk * PARALLEL_CHUNK_SIZE);
+        end = parallel_chunk_boundary(scan, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+        if (start == end)
+            continue;
+
+        matcher_set_range(matcher, start, end);
+        while (!atomic_load_explicit(&scan->stop, memory_order_relaxed)
+               && matcher_next(matcher, &substring_start, &substring_length))
+        {
+            spans = worker->spans + worker->batch_count * matcher->group_count;
+            memcpy(spans, matcher->spans, matcher->group_count * sizeof(*spans));
+            match = &worker->batch[worker->batch_count++];
+            *match = (ParallelMatch){ .spans = spans, .pattern_index = matcher->pattern_index };
+            matcher_match_offsets(matcher, &match->match_start, &match->match_end);
+            if (worker->batch_count == PARALLEL_BATCH_SIZE)
+                parallel_worker_flush(worker);
+        }
+        if (matcher->match_error) {
+            atomic_store(&scan->match_error, matcher->match_error);
+            atomic_store(&scan->stop, 1);
+        }
+    }
+
+    parallel_worker_flush(worker);
+    pthread_mutex_lock(&scan->lock);
+    matcher_add_skipped_lines(matcher, scan->skipped_lines);
+    pthread_mutex_unlock(&scan->lock);
+ret:
+    matcher_deinit(matcher);
+    allocator_deinit(&worker->allocator);
+    return NULL;
+}
+
+// Match "subject" with "jobs" threads, each one with its own match state built
+// from the compiled pattern of "source". Matches are delivered to "sink" in no
+// particular order. Returns 0 if no worker could be started. A PCRE2 error
+// that stopped matching is stored in "match_error_out", 0 if there was none,
+// and the lines skipped by the workers are added to "skipped_lines".
+int parallel_scan(Matcher *source,
+                  PCRE2_SPTR subject,
+                  PCRE2_SIZE subject_length,
+                  size_t jobs,
+                  ParallelSink sink,
+                  void *sink_data,
+                  int *match_error_out,
+                  size_t *skipped_lines)
+{
+    ParallelScan scan = {
+        .source = source,
+        .subject = subject,
+        .subject_length = subject_length,
+        .chunk_count = (subject_length + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE,
+        .sink = sink,
+        .sink_data = sink_data,
+    };
+    ParallelWorker *workers;
+    pthread_t *threads;
+    size_t i, started = 0;
+    int ok = 0;
+
+    // a worker per chunk at most, the others would have nothing to do
+    if (jobs > scan.chunk_count)
+        jobs = (scan.chunk_count > 0) ? scan.chunk_count : 1;
+
+    atomic_init(&scan.next_chunk, 0);
+    atomic_init(&scan.stop, 0);
+    atomic_init(&scan.match_error, 0);
+    pthread_mutex_init(&scan.lock, NULL);
+
+    workers = calloc(jobs, sizeof(*workers));
+    threads = calloc(jobs, sizeof(*threads));
+    if (!workers || !threads)
+        goto ret;
+
+    matcher_jit_compile(source);
+
+    for (i = 0; i < jobs; i++) {
+        workers[i].scan = &scan;
+        workers[i].spans = malloc(PARALLEL_BATCH_SIZE * source->group_count * sizeof(*workers[i].spans));
+        if (!workers[i].spans || pthread_create(&threads[i], NULL, parallel_worker_run, &workers[i]) != 0) {
+            free(workers[i].spans);
+            break;
+        }
+        started++;
+    }
+
+    // if a worker failed to start, the others still finish all the chunks
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        free(workers[i].spans);
+        ok = ok || !workers[i].failed;
+    }
+
+ret:
+    *match_error_out = atomic_load(&scan.match_error);
+    for (i = 0; i < MATCHER_SKIP_REASON_COUNT; i++)
+        skipped_lines[i] += scan.skipped_lines[i];
+    pthread_mutex_destroy(&scan.lock);
+    free(threads);
+    free(workers);
+    return ok;
+}
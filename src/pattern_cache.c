@@ -0,0 +1,168 @@
+// An on-disk cache of compiled patterns, so repeated runs with the same
+// (possibly huge) pattern skip pcre2_compile. Every pattern is a file named by
+// the hash of its text, its compile options and the PCRE2 version. The file
+// holds a header, the pattern text (to tell hash collisions apart) and the code
+// serialized by pcre2_serialize_encode. JIT code can't be serialized, it's
+// compiled again when the pattern is first used. PCRE2 doesn't validate the
+// code it decodes, so the header keeps a hash of it that is checked first.
+//
+// The cache is best-effort: a missing, stale or corrupted entry is compiled
+// again and replaced, and failing to store an entry is not an error. Entries
+// are written to a temporary file and renamed into place, so concurrent runs
+// never see half-written ones.
+
+static const char PATTERN_CACHE_MAGIC[8] = { 'g', 'r', 'u', 'n', 'i', 'q', 'p', 'c' };
+static const uint64_t PATTERN_CACHE_SEED = 0x2f6e1c07d3a9b845ull;
+
+typedef struct {
+    char magic[8];
+    uint64_t key;
+    uint32_t options, extra_options;
+    uint64_t pattern_length, code_length;
+    // hash64 of the serialized code
+    uint64_t code_hash;
+} PatternCacheHeader;
+
+typedef struct {
+    const char *dir;
+    uint64_t key;
+    uint32_t options, extra_options;
+    PCRE2_SPTR pattern;
+    PCRE2_SIZE pattern_length;
+} PatternCacheEntry;
+
+// Set up the cache entry of a pattern compiled with "options" and
+// "extra_options". "dir" and "pattern" must outlive it.
+void pattern_cache_entry_init(PatternCacheEntry *entry,
+                              const char *dir,
+                              PCRE2_SPTR pattern,
+                              PCRE2_SIZE pattern_length,
+                              uint32_t options,
+                              uint32_t extra_options)
+{
+    const uint32_t salt[] = { PCRE2_MAJOR, PCRE2_MINOR, options, extra_options };
+    const HashField fields[] = {
+        { .data = salt, .length = sizeof(salt) },
+        { .data = pattern, .length = pattern_length },
+    };
+
+    *entry = (PatternCacheEntry){
+        .dir = dir,
+        .key = hash64_fields(fields, sizeof(fields) / sizeof(fields[0]), PATTERN_CACHE_SEED),
+        .options = options,
+        .extra_options = extra_options,
+        .pattern = pattern,
+        .pattern_length = pattern_length,
+    };
+}
+
+// "dir/<key>" plus "suffix", NULL if memory allocation failed.
+static char *pattern_cache_path(const PatternCacheEntry *entry, const char *suffix) {
+    size_t size = strlen(entry->dir) + 1 + 16 + strlen(suffix) + 1;
+    char *path;
+
+    if ( !(path = malloc(size)))
+        return NULL;
+    snprintf(path, size, "%s/%016llx%s", entry->dir, (unsigned long long)entry->key, suffix);
+    return path;
+}
+
+// Returns the cached code of the pattern, allocated with "general_context",
+// NULL if there's none that can be used.
+pcre2_code *pattern_cache_load(const PatternCacheEntry *entry, pcre2_general_context *general_context) {
+    sth_io_file_view_t view = { 0 };
+    PatternCacheHeader header;
+    pcre2_code *code = NULL;
+    const uint8_t *p;
+    char *path;
+
+    if ( !(path = pattern_cache_path(entry, "")))
+        return NULL;
+    if (!sth_io_file_view_open(path, &view)) {
+        free(path);
+        return NULL;
+    }
+    free(path);
+
+    if (view.size < sizeof(header))
+        goto ret;
+    memcpy(&header, view.data, sizeof(header));
+    p = (const uint8_t *)view.data + sizeof(header);
+    if (memcmp(header.magic, PATTERN_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.key != entry->key
+        || header.options != entry->options
+        || header.extra_options != entry->extra_options
+        || header.pattern_length != entry->pattern_length
+        || header.pattern_length > view.size - sizeof(header)
+        || header.code_length > view.size - sizeof(header) - header.pattern_length
+        || (entry->pattern_length > 0 && memcmp(p, entry->pattern, entry->pattern_length) != 0)
+        || hash64(p + header.pattern_length, header.code_length, PATTERN_CACHE_SEED) != header.code_hash)
+    {
+        goto ret;
+    }
+    // decoding checks the PCRE2 build and the byte order of the code itself
+    if (pcre2_serialize_decode(&code, 1, p + header.pattern_length, general_context) != 1)
+        code = NULL;
+
+ret:
+    sth_io_file_view_close(&view);
+    return code;
+}
+
+static int pattern_cache_write(int fd, const void *data, size_t size) {
+    const char *p = data;
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= (size_t)n;
+    }
+    return 1;
+}
+
+// Store "code" as the cached code of the pattern. Returns 0 if it couldn't be
+// stored, which callers may ignore.
+int pattern_cache_store(const PatternCacheEntry *entry, const pcre2_code *code) {
+    PatternCacheHeader header = {
+        .key = entry->key,
+        .options = entry->options,
+        .extra_options = entry->extra_options,
+        .pattern_length = entry->pattern_length,
+    };
+    uint8_t *bytes = NULL;
+    PCRE2_SIZE size;
+    char *path = NULL, *tmp_path = NULL;
+    int fd = -1, ok = 0;
+
+    if (!sth_os_mkdir_if_not_exists(entry->dir))
+        return 0;
+    if (pcre2_serialize_encode(&code, 1, &bytes, &size, NULL) != 1)
+        return 0;
+    memcpy(header.magic, PATTERN_CACHE_MAGIC, sizeof(header.magic));
+    header.code_length = size;
+    header.code_hash = hash64(bytes, size, PATTERN_CACHE_SEED);
+
+    path = pattern_cache_path(entry, "");
+    tmp_path = pattern_cache_path(entry, ".tmp-XXXXXX");
+    if (!path || !tmp_path || (fd = mkstemp(tmp_path)) < 0)
+        goto ret;
+
+    ok = pattern_cache_write(fd, &header, sizeof(header))
+         && pattern_cache_write(fd, entry->pattern, entry->pattern_length)
+         && pattern_cache_write(fd, bytes, size);
+    ok = (close(fd) == 0) && ok;
+    ok = ok && sth_os_rename(tmp_path, path);
+    if (!ok)
+        unlink(tmp_path);
+
+ret:
+    free(tmp_path);
+    free(path);
+    pcre2_serialize_free(bytes);
+    return ok;
+}
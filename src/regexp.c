@@ -1,57 +1,1210 @@
 static const uint32_t REGEXP_PCRE2_JIT_OPTIONS = PCRE2_JIT_COMPLETE;
 static const uint32_t REGEXP_PCRE2_JIT_STACK_START_SIZE = 32 * 1024;
 static const uint32_t REGEXP_PCRE2_JIT_STACK_MAX_SIZE = 512 * 1024;
+// a match that runs out of JIT stack is retried with twice as much, up to this
+static const uint32_t REGEXP_PCRE2_JIT_STACK_LIMIT_SIZE = 64 * 1024 * 1024;
+// The prefilter is turned off when, after this many candidate lines, it skips
+// less than REGEXP_PREFILTER_MIN_SKIP bytes per candidate on average. A call to
+// pcre2_match per line costs more than that is worth. DFA matchers keep it:
+// without JIT, a caseless first code unit is searched up to the end of the
+// subject on every call, and the prefilter ends the subject at the line end.
+static const size_t REGEXP_PREFILTER_CHECK_INTERVAL = 1024;
+static const size_t REGEXP_PREFILTER_MIN_SKIP = 64;
+// Pattern sets are matched window by window: every pattern runs over a window
+// before the next one is read, so the input is read once and each window is
+// still in cache for all the patterns but the first. Only sets whose matches
+// can't span lines are windowed, a window ends a match like the subject end.
+static const size_t REGEXP_WINDOW_SIZE = 256 * 1024;
+// When every pattern of a windowed set has a prefilter literal, the set looks
+// for all of them at once and only lines with one of them are windowed. A
+// window ends after this many bytes without any, shorter gaps cost less to
+// scan with every pattern than a window of their own.
+static const size_t REGEXP_SET_PREFILTER_GAP = 4 * 1024;
+// Patterns are JIT compiled when they're first used on at least this much
+// text. Below that, compiling costs more than it saves and the interpreter is
+// used.
+static const size_t REGEXP_JIT_MIN_SUBJECT_SIZE = 64 * 1024;
+// in ints, the DFA workspace doubles when a match needs more
+static const size_t REGEXP_DFA_WORKSPACE_START_SIZE = 1024;
+static const size_t REGEXP_DFA_WORKSPACE_MAX_SIZE = 1024 * 1024;
+
+typedef enum {
+    MATCHER_ENGINE_PCRE2,
+    // fixed strings, searched without PCRE2
+    MATCHER_ENGINE_LITERAL,
+    // several fixed strings, picked by the matcher for literal pattern sets
+    MATCHER_ENGINE_AHO_CORASICK,
+    // several patterns, each one with its own matcher
+    MATCHER_ENGINE_SET,
+} MatcherEngine;
+
+typedef struct {
+    const char *data;
+    size_t length;
+} MatcherPattern;
+
+typedef struct {
+    PCRE2_SPTR start;
+    PCRE2_SIZE length;
+} MatcherSpan;
 
 typedef struct {
+    MatcherEngine engine;
+    int caseless;
+    // match UTF-8 characters instead of bytes. Subjects must be checked with
+    // matcher_check_utf, invalid sequences never match
+    int utf;
+    // compile for input with invalid UTF-8, set by matcher_check_utf
+    int invalid_utf;
+    // the dot matches newlines too
+    int dotall;
+    // matches must be whole lines or whole words
+    int line, word;
+    // plain parentheses don't capture, like (?:...)
+    int no_capture;
+    // comma separated numbers or names of the capture groups to extract, NULL
+    // for whole matches
+    const char *groups;
+    // directory of the compiled pattern cache, NULL to always compile
+    const char *cache_dir;
+    // where PCRE2 allocates from, NULL for malloc
+    pcre2_general_context *general_context;
+    // match with pcre2_dfa_match instead of pcre2_match
+    int dfa;
+    // budgets of a single match (the heap one in KB), 0 for PCRE2's defaults
+    uint32_t match_limit, depth_limit, heap_limit;
+} MatcherOptions;
+
+// Why a line was skipped: matching it went over one of the budgets.
+typedef enum {
+    MATCHER_SKIP_MATCH_LIMIT,
+    MATCHER_SKIP_DEPTH_LIMIT,
+    MATCHER_SKIP_HEAP_LIMIT,
+    MATCHER_SKIP_JIT_STACK,
+    MATCHER_SKIP_DFA_WORKSPACE,
+    MATCHER_SKIP_REASON_COUNT,
+} MatcherSkipReason;
+
+static const char *const MATCHER_SKIP_REASON_NAMES[MATCHER_SKIP_REASON_COUNT] = {
+    "match limit",
+    "depth limit",
+    "heap limit",
+    "JIT stack limit",
+    "DFA workspace limit",
+};
+
+typedef enum {
+    MATCHER_PREFILTER_NONE,
+    // matches start with the literal
+    MATCHER_PREFILTER_FIRST,
+    // matches contain the literal somewhere in their line
+    MATCHER_PREFILTER_LAST,
+} MatcherPrefilter;
+
+typedef struct Matcher {
+    MatcherEngine engine;
+    Literal literal;
+    AhoCorasick aho_corasick;
+    AhoCorasickCursor cursor;
+    // the end of the last match of every string, so that matches of the same
+    // string don't overlap
+    size_t *pattern_ends;
     pcre2_code *re_code;
     pcre2_match_data *match_data;
     pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+    pcre2_general_context *general_context;
     PCRE2_SPTR pattern, subject;
-    PCRE2_SIZE subject_length, offset, error_offset;
+    PCRE2_SIZE pattern_length, subject_length, offset, error_offset;
+    // the whole last match, the reported span is its first group
+    PCRE2_SIZE match_start, match_end;
+    // set after an empty match at the offset, the next one can't be there too
+    int empty_match;
+    // a CR LF pair is a newline, the offset never stops between the two
+    int crlf;
+    // the subject is valid UTF-8, PCRE2 doesn't check it on every match
+    int utf_checked;
+    // re_code is compiled with PCRE2_MATCH_INVALID_UTF
+    int invalid_utf;
+    // the groups to extract and their spans in the last match
+    uint32_t *groups;
+    MatcherSpan *spans;
+    size_t group_count;
+    // with several patterns, the one the last match is for and the one that
+    // failed to compile
+    size_t pattern_count, pattern_index, error_pattern;
+    // matchers of a pattern set, "current" is the one matching the window
+    // [window_start, window_end) of [offset, range_end)
+    struct Matcher *matchers;
+    size_t current;
+    PCRE2_SIZE window_start, window_end, range_end;
+    // the prefilter literals of all the patterns of a set, empty if it has none
+    SimdByteSet set_units;
+    // set when no match can span lines, so the subject can be split at line
+    // boundaries into windows or parallel chunks
+    int line_local;
     int error_code;
+    // non-zero if re_code (or the literal) is borrowed from another matcher
+    int shared_code;
+    // set until re_code is JIT compiled
+    int jit_pending;
+    // pcre2_dfa_match never backtracks: its time is linear in the subject, it
+    // reports the longest match at the leftmost position and has no captures
+    int dfa;
+    int *dfa_workspace;
+    size_t dfa_workspace_size;
+    uint32_t match_limit, depth_limit, heap_limit;
+    // the biggest the JIT stack may grow to at the moment
+    uint32_t jit_stack_size;
+    // the error that stopped matching, 0 if matching didn't fail
+    int match_error;
+    // set after a match went over a budget, until the line at fault is found
+    int line_by_line;
+    // lines skipped for going over a budget, by reason
+    size_t skipped_lines[MATCHER_SKIP_REASON_COUNT];
+    // a code unit every match has, in both cases for ASCII letters
+    MatcherPrefilter prefilter;
+    uint8_t prefilter_units[2];
+    size_t prefilter_candidates, prefilter_skipped;
 } Matcher;
 
+// Conservatively check that nothing in "pattern" can match (or look at) a
+// newline, so every match lies within a single line. Anything that is hard to
+// tell about (negated classes, \s, \x.., \p.., (?s), verbs, ...) fails the check.
+static int matcher_pattern_is_line_local(PCRE2_SPTR pattern, PCRE2_SIZE length) {
+    // escapes that never match a newline
+    static const char safe_escapes[] = "abBdefhgkrtwAKQEV";
+    const char *p = (const char *)pattern, *end = p + length;
+
+    for (; p < end; p++) {
+        // raw control characters, also as class range bounds
+        if ((unsigned char)*p < 0x0e)
+            return 0;
+        switch (*p) {
+        case '\\':
+            if (++p == end)
+                return 0;
+            if (((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))
+                && !strchr(safe_escapes, *p))
+            {
+                return 0;
+            }
+            break;
+        case '[':
+            if (p + 1 < end && (p[1] == '^' || p[1] == ':'))
+                return 0;
+            break;
+        case '(':
+            if (p + 1 < end && p[1] == '*')
+                return 0;
+            if (p + 1 < end && p[1] == '?') {
+                // inline options, (?s) makes the dot match newlines
+                for (p += 2;
+                     p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '-' || *p == '^');
+                     p++)
+                {
+                    if (*p == 's')
+                        return 0;
+                }
+                p--;
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+// Tell whether no match of the matcher's pattern can span (or look past) a
+// line, fixed strings included.
+static int matcher_is_line_local(const Matcher *matcher) {
+    uint32_t options, newline;
+
+    if (matcher->re_code) {
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_ALLOPTIONS, &options);
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_NEWLINE, &newline);
+        if ((options & PCRE2_DOTALL) || newline != PCRE2_NEWLINE_LF)
+            return 0;
+    }
+    return matcher_pattern_is_line_local(matcher->pattern, matcher->pattern_length);
+}
+
+// Pick a literal code unit that every match must contain, so matching can jump
+// from one line with that unit to the next with a byte search. Only patterns
+// whose matches can't span (or be empty or look past) a line are prefiltered.
+static void matcher_init_prefilter(Matcher *matcher) {
+    uint32_t type, unit;
+    size_t min_length;
+
+    matcher->prefilter = MATCHER_PREFILTER_NONE;
+    pcre2_pattern_info(matcher->re_code, PCRE2_INFO_MINLENGTH, &min_length);
+    if (min_length == 0 || !matcher->line_local)
+        return;
+
+    // the last literal is usually rarer than the first one
+    pcre2_pattern_info(matcher->re_code, PCRE2_INFO_LASTCODETYPE, &type);
+    if (type == 1) {
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_LASTCODEUNIT, &unit);
+        matcher->prefilter = MATCHER_PREFILTER_LAST;
+    } else {
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_FIRSTCODETYPE, &type);
+        if (type != 1)
+            return;
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_FIRSTCODEUNIT, &unit);
+        matcher->prefilter = MATCHER_PREFILTER_FIRST;
+    }
+
+    // pattern info doesn't tell if the unit is caseless, search both cases
+    matcher->prefilter_units[0] = (uint8_t)unit;
+    matcher->prefilter_units[1] = (uint8_t)unit;
+    if (unit >= 'a' && unit <= 'z')
+        matcher->prefilter_units[1] = (uint8_t)(unit - 'a' + 'A');
+    else if (unit >= 'A' && unit <= 'Z')
+        matcher->prefilter_units[1] = (uint8_t)(unit - 'A' + 'a');
+}
+
+// Create the per-matcher state. Compiled code is read-only and can be shared
+// between threads but match data and the JIT stack can't.
+static int matcher_init_match_state(Matcher *matcher) {
+    matcher->match_data = pcre2_match_data_create_from_pattern(matcher->re_code, matcher->general_context);
+    matcher->jit_stack_size = REGEXP_PCRE2_JIT_STACK_MAX_SIZE;
+    matcher->jit_stack = pcre2_jit_stack_create(REGEXP_PCRE2_JIT_STACK_START_SIZE,
+                                                matcher->jit_stack_size,
+                                                matcher->general_context);
+    matcher->match_context = pcre2_match_context_create(matcher->general_context);
+    if (matcher->dfa) {
+        matcher->dfa_workspace_size = REGEXP_DFA_WORKSPACE_START_SIZE;
+        matcher->dfa_workspace = malloc(matcher->dfa_workspace_size * sizeof(*matcher->dfa_workspace));
+    }
+    if (!matcher->match_data || !matcher->jit_stack || !matcher->match_context
+        || (matcher->dfa && !matcher->dfa_workspace))
+    {
+        matcher->error_code = PCRE2_ERROR_NOMEMORY;
+        return 0;
+    }
+
+    pcre2_jit_stack_assign(matcher->match_context, NULL, matcher->jit_stack);
+    if (matcher->match_limit)
+        pcre2_set_match_limit(matcher->match_context, matcher->match_limit);
+    if (matcher->depth_limit)
+        pcre2_set_depth_limit(matcher->match_context, matcher->depth_limit);
+    if (matcher->heap_limit)
+        pcre2_set_heap_limit(matcher->match_context, matcher->heap_limit);
+    return 1;
+}
+
+// A pattern without PCRE2 metacharacters matches itself.
+static int matcher_pattern_is_literal(const MatcherPattern *pattern) {
+    static const char metacharacters[] = "\\^$.|?*+()[]{}";
+    size_t i;
+
+    for (i = 0; i < pattern->length; i++) {
+        if (memchr(metacharacters, pattern->data[i], sizeof(metacharacters) - 1))
+            return 0;
+    }
+    return pattern->length > 0;
+}
+
+static int matcher_init_aho_corasick(Matcher *matcher,
+                                     const MatcherPattern *patterns,
+                                     size_t pattern_count,
+                                     int caseless)
+{
+    size_t i;
+
+    matcher->engine = MATCHER_ENGINE_AHO_CORASICK;
+    matcher->cursor = AHO_CORASICK_CURSOR_INIT;
+    if (!aho_corasick_init(&matcher->aho_corasick, pattern_count, caseless)
+        || !(matcher->pattern_ends = calloc(pattern_count, sizeof(*matcher->pattern_ends))))
+    {
+        goto fail;
+    }
+    for (i = 0; i < pattern_count; i++) {
+        if (!aho_corasick_add(&matcher->aho_corasick, i, patterns[i].data, patterns[i].length))
+            goto fail;
+    }
+    if (!aho_corasick_build(&matcher->aho_corasick))
+        goto fail;
+
+    matcher->line_local = 1;
+    for (i = 0; i < pattern_count && matcher->line_local; i++)
+        matcher->line_local = !memchr(patterns[i].data, '\n', patterns[i].length);
+    return 1;
+
+fail:
+    matcher->error_code = PCRE2_ERROR_NOMEMORY;
+    return 0;
+}
+
+int matcher_init(Matcher *matcher,
+                 const MatcherPattern *patterns,
+                 size_t pattern_count,
+                 const MatcherOptions *options,
+                 PCRE2_SPTR subject,
+                 PCRE2_SIZE subject_length);
+
+// Share the prefilters of a windowed set: a line without any of the literals
+// of its patterns has no match, so it can be skipped by all of them at once.
+// Every pattern needs a literal, and there can't be too many of them.
+static void matcher_init_set_prefilter(Matcher *matcher) {
+    const Matcher *current;
+    size_t i;
+
+    simd_byte_set_init(&matcher->set_units);
+    if (!matcher->line_local)
+        return;
+    for (i = 0; i < matcher->pattern_count; i++) {
+        current = &matcher->matchers[i];
+        if (current->prefilter == MATCHER_PREFILTER_NONE
+            || !simd_byte_set_add(&matcher->set_units, current->prefilter_units[0])
+            || !simd_byte_set_add(&matcher->set_units, current->prefilter_units[1]))
+        {
+            simd_byte_set_init(&matcher->set_units);
+            return;
+        }
+    }
+}
+
+// Give every pattern of the set its own matcher. Returns 0 with the error of the
+// first pattern that failed to compile.
+static int matcher_init_set(Matcher *matcher,
+                            const MatcherPattern *patterns,
+                            size_t pattern_count,
+                            const MatcherOptions *options)
+{
+    size_t i;
+
+    matcher->engine = MATCHER_ENGINE_SET;
+    matcher->current = pattern_count;
+    matcher->range_end = matcher->subject_length;
+    if ( !(matcher->matchers = calloc(pattern_count, sizeof(*matcher->matchers)))) {
+        matcher->error_code = PCRE2_ERROR_NOMEMORY;
+        return 0;
+    }
+
+    for (i = 0; i < pattern_count; i++) {
+        if (!matcher_init(&matcher->matchers[i], &patterns[i], 1, options,
+                          matcher->subject, matcher->subject_length))
+        {
+            matcher->error_pattern = i;
+            matcher->error_code = matcher->matchers[i].error_code;
+            matcher->error_offset = matcher->matchers[i].error_offset;
+            return 0;
+        }
+    }
+
+    matcher->line_local = 1;
+    for (i = 0; i < pattern_count && matcher->line_local; i++)
+        matcher->line_local = matcher->matchers[i].line_local;
+    matcher_init_set_prefilter(matcher);
+    return 1;
+}
+
+// The literal engines only fold ASCII letters and know nothing of word or line
+// boundaries, PCRE2 handles the patterns they can't. In UTF mode, K and S also
+// fold to the Kelvin sign and the long s.
+static int matcher_can_search_literally(const MatcherPattern *pattern, const MatcherOptions *options) {
+    size_t i;
+
+    if (options->line || options->word)
+        return 0;
+    if (options->caseless && options->utf) {
+        for (i = 0; i < pattern->length; i++) {
+            if ((unsigned char)pattern->data[i] >= 0x80 || memchr("kKsS", pattern->data[i], 4))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Escape every ASCII punctuation character of a fixed string, so PCRE2 matches
+// it literally. PCRE2_LITERAL can't be used, it doesn't allow PCRE2_MULTILINE.
+// Returns NULL if memory allocation failed.
+static char *matcher_quote_pattern(const MatcherPattern *pattern, size_t *length_out) {
+    char *quoted, *q;
+    size_t i;
+    unsigned char c;
+
+    if ( !(quoted = malloc(pattern->length * 2 + 1)))
+        return NULL;
+    for (i = 0, q = quoted; i < pattern->length; i++) {
+        c = (unsigned char)pattern->data[i];
+        if (c < 0x80 && !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+            *q++ = '\\';
+        *q++ = (char)c;
+    }
+    *length_out = (size_t)(q - quoted);
+    return quoted;
+}
+
+static uint32_t matcher_compile_flags(const MatcherOptions *options) {
+    uint32_t flags = PCRE2_MULTILINE;
+
+    if (options->caseless)
+        flags |= PCRE2_CASELESS;
+    if (options->utf)
+        flags |= PCRE2_UTF;
+    if (options->utf && options->invalid_utf)
+        flags |= PCRE2_MATCH_INVALID_UTF;
+    if (options->dotall)
+        flags |= PCRE2_DOTALL;
+    if (options->no_capture)
+        flags |= PCRE2_NO_AUTO_CAPTURE;
+    return flags;
+}
+
+// Compile the pattern with PCRE2, fixed strings are quoted first. -x and -w
+// are PCRE2's extra options, which wrap the pattern in ^(?:...)$ or
+// \b(?:...)\b.
+static int matcher_compile(Matcher *matcher, const MatcherOptions *options) {
+    pcre2_compile_context *compile_context = NULL;
+    PatternCacheEntry cache_entry;
+    PCRE2_SPTR pattern = matcher->pattern;
+    PCRE2_SIZE pattern_length = matcher->pattern_length;
+    char *quoted = NULL;
+    uint32_t extra = 0;
+
+    if (options->engine == MATCHER_ENGINE_LITERAL) {
+        MatcherPattern literal = { (const char *)pattern, pattern_length };
+        if ( !(quoted = matcher_quote_pattern(&literal, &pattern_length))) {
+            matcher->error_code = PCRE2_ERROR_NOMEMORY;
+            return 0;
+        }
+        pattern = (PCRE2_SPTR)quoted;
+    }
+    if (options->line)
+        extra |= PCRE2_EXTRA_MATCH_LINE;
+    else if (options->word)
+        extra |= PCRE2_EXTRA_MATCH_WORD;
+    // the code is allocated with the compile context's general context
+    if ( !(compile_context = pcre2_compile_context_create(matcher->general_context))) {
+        free(quoted);
+        matcher->error_code = PCRE2_ERROR_NOMEMORY;
+        return 0;
+    }
+    pcre2_set_compile_extra_options(compile_context, extra);
+
+    matcher->engine = MATCHER_ENGINE_PCRE2;
+    if (options->cache_dir) {
+        pattern_cache_entry_init(&cache_entry, options->cache_dir, pattern, pattern_length,
+                                 matcher_compile_flags(options), extra);
+        matcher->re_code = pattern_cache_load(&cache_entry, matcher->general_context);
+    }
+    if (!matcher->re_code) {
+        matcher->re_code = pcre2_compile(
+            pattern,
+            pattern_length,
+            matcher_compile_flags(options),
+            &matcher->error_code,
+            &matcher->error_offset,
+            compile_context
+        );
+        if (matcher->re_code && options->cache_dir)
+            pattern_cache_store(&cache_entry, matcher->re_code);
+    }
+    pcre2_compile_context_free(compile_context);
+    free(quoted);
+    return matcher->re_code != NULL;
+}
+
+// Resolve one group to extract to its number. Fixed strings have no groups but
+// the whole match, group 0.
+static int matcher_resolve_group(Matcher *matcher, const char *group, uint32_t *number_out) {
+    uint32_t capture_count = 0;
+    unsigned long number;
+    char *end;
+    int rc;
+
+    if (matcher->re_code)
+        pcre2_pattern_info(matcher->re_code, PCRE2_INFO_CAPTURECOUNT, &capture_count);
+
+    number = strtoul(group, &end, 10);
+    if (*group >= '0' && *group <= '9' && *end == '\0') {
+        if (number > capture_count) {
+            matcher->error_code = PCRE2_ERROR_NOSUBSTRING;
+            return 0;
+        }
+        *number_out = (uint32_t)number;
+        return 1;
+    }
+
+    rc = matcher->re_code ? pcre2_substring_number_from_name(matcher->re_code, (PCRE2_SPTR)group)
+                          : PCRE2_ERROR_NOSUBSTRING;
+    if (rc < 0) {
+        matcher->error_code = rc;
+        return 0;
+    }
+    *number_out = (uint32_t)rc;
+    return 1;
+}
+
+// Resolve the comma separated groups to extract, the whole match when there
+// are none. A set only needs room for the spans of its matchers.
+static int matcher_init_groups(Matcher *matcher, const char *groups) {
+    char *names = NULL, *name, *comma;
+    size_t i;
+
+    matcher->group_count = 1;
+    for (i = 0; groups && groups[i]; i++)
+        matcher->group_count += (groups[i] == ',');
+
+    matcher->spans = calloc(matcher->group_count, sizeof(*matcher->spans));
+    if (matcher->engine != MATCHER_ENGINE_SET)
+        matcher->groups = calloc(matcher->group_count, sizeof(*matcher->groups));
+    if (!matcher->spans || (matcher->engine != MATCHER_ENGINE_SET && !matcher->groups)
+        || (groups && !(names = strdup(groups))))
+    {
+        matcher->error_code = PCRE2_ERROR_NOMEMORY;
+        return 0;
+    }
+    if (!names || matcher->engine == MATCHER_ENGINE_SET) {
+        free(names);
+        return 1;
+    }
+
+    for (i = 0, name = names; i < matcher->group_count; i++, name = comma + 1) {
+        if ((comma = strchr(name, ',')))
+            *comma = '\0';
+        if (!matcher_resolve_group(matcher, name, &matcher->groups[i])) {
+            free(names);
+            return 0;
+        }
+    }
+    free(names);
+    return 1;
+}
+
+// The DFA can't match back references, that's the only unsupported item that
+// can be told before matching.
+static int matcher_init_dfa(Matcher *matcher) {
+    uint32_t backref_max;
+
+    pcre2_pattern_info(matcher->re_code, PCRE2_INFO_BACKREFMAX, &backref_max);
+    if (backref_max > 0) {
+        matcher->error_code = PCRE2_ERROR_DFA_UITEM;
+        return 0;
+    }
+    matcher->dfa = 1;
+    return 1;
+}
+
+// Initialize a matcher for one pattern or for a set of them. Sets of fixed
+// strings (with -F, or when no pattern has a metacharacter) are matched with an
+// Aho-Corasick automaton, other sets with a matcher per pattern.
 int matcher_init(Matcher *matcher,
-                 PCRE2_SPTR pattern,
+                 const MatcherPattern *patterns,
+                 size_t pattern_count,
+                 const MatcherOptions *options,
                  PCRE2_SPTR subject,
                  PCRE2_SIZE subject_length)
 {
-    matcher->pattern = pattern;
+    uint32_t newline;
+    int literals = 1;
+    size_t i;
+
+    matcher->engine = options->engine;
+    matcher->invalid_utf = options->invalid_utf;
+    matcher->pattern = (PCRE2_SPTR)patterns[0].data;
+    matcher->pattern_length = patterns[0].length;
+    matcher->pattern_count = pattern_count;
+    matcher->general_context = options->general_context;
+    matcher->match_limit = options->match_limit;
+    matcher->depth_limit = options->depth_limit;
+    matcher->heap_limit = options->heap_limit;
     matcher->subject = subject;
     matcher->subject_length = subject_length;
 
-    pcre2_code *re_code;
-    re_code = pcre2_compile(
-        pattern,
-        PCRE2_ZERO_TERMINATED,
-        PCRE2_CASELESS | PCRE2_MULTILINE,
-        &matcher->error_code,
-        &matcher->error_offset,
-        NULL
-    );
+    if (pattern_count > 1) {
+        for (i = 0; i < pattern_count && literals; i++) {
+            literals = (options->engine == MATCHER_ENGINE_LITERAL || matcher_pattern_is_literal(&patterns[i]))
+                       && matcher_can_search_literally(&patterns[i], options);
+        }
+        if (literals) {
+            return matcher_init_aho_corasick(matcher, patterns, pattern_count, options->caseless)
+                   && matcher_init_groups(matcher, options->groups);
+        }
+        return matcher_init_set(matcher, patterns, pattern_count, options)
+               && matcher_init_groups(matcher, options->groups);
+    } else if (options->engine == MATCHER_ENGINE_LITERAL && matcher_can_search_literally(&patterns[0], options)) {
+        if (!literal_init(&matcher->literal, patterns[0].data, patterns[0].length, options->caseless)) {
+            matcher->error_code = PCRE2_ERROR_NOMEMORY;
+            return 0;
+        }
+        matcher->line_local = !memchr(patterns[0].data, '\n', patterns[0].length);
+        return matcher_init_groups(matcher, options->groups);
+    }
 
-    if (!re_code)
+    if (!matcher_compile(matcher, options) || !matcher_init_groups(matcher, options->groups))
         return 0;
 
-    pcre2_jit_compile(re_code, REGEXP_PCRE2_JIT_OPTIONS);
-    matcher->match_data = pcre2_match_data_create_from_pattern(re_code, NULL);
+    if (options->dfa) {
+        if (!matcher_init_dfa(matcher))
+            return 0;
+    } else {
+        matcher->jit_pending = 1;
+    }
+    pcre2_pattern_info(matcher->re_code, PCRE2_INFO_NEWLINE, &newline);
+    matcher->crlf = (newline == PCRE2_NEWLINE_CRLF || newline == PCRE2_NEWLINE_ANY
+                     || newline == PCRE2_NEWLINE_ANYCRLF);
+    matcher->line_local = matcher_is_line_local(matcher);
+    matcher_init_prefilter(matcher);
+    return matcher_init_match_state(matcher);
+}
 
-    pcre2_jit_stack *jit_stack = pcre2_jit_stack_create(REGEXP_PCRE2_JIT_STACK_START_SIZE,
-                                                        REGEXP_PCRE2_JIT_STACK_MAX_SIZE,
-                                                        NULL);
+// JIT compile the patterns that weren't yet. Code is read-only once it's
+// shared between threads, so this must be done before.
+void matcher_jit_compile(Matcher *matcher) {
+    size_t i;
 
-    matcher->match_context = pcre2_match_context_create(NULL);
-    pcre2_jit_stack_assign(matcher->match_context, NULL, jit_stack);
+    if (matcher->engine == MATCHER_ENGINE_SET) {
+        for (i = 0; i < matcher->pattern_count; i++)
+            matcher_jit_compile(&matcher->matchers[i]);
+    } else if (matcher->jit_pending) {
+        pcre2_jit_compile(matcher->re_code, REGEXP_PCRE2_JIT_OPTIONS);
+        matcher->jit_pending = 0;
+    }
+}
 
-    matcher->re_code = re_code;
-    return 1;
+// Initialize a matcher that uses the compiled pattern of "source", so worker
+// threads don't have to compile the pattern again. Its own state is allocated
+// with "general_context" (NULL for malloc). "source" must outlive it and be
+// JIT compiled with matcher_jit_compile first.
+int matcher_init_shared(Matcher *matcher, const Matcher *source, pcre2_general_context *general_context) {
+    size_t i;
+
+    *matcher = (Matcher){
+        .engine = source->engine,
+        .literal = source->literal,
+        .aho_corasick = source->aho_corasick,
+        .cursor = AHO_CORASICK_CURSOR_INIT,
+        .re_code = source->re_code,
+        .pattern = source->pattern,
+        .pattern_length = source->pattern_length,
+        .pattern_count = source->pattern_count,
+        .groups = source->groups,
+        .group_count = source->group_count,
+        .subject = source->subject,
+        .subject_length = source->subject_length,
+        .shared_code = 1,
+        .line_local = source->line_local,
+        .prefilter = source->prefilter,
+        .prefilter_units = { source->prefilter_units[0], source->prefilter_units[1] },
+        .set_units = source->set_units,
+        .general_context = general_context,
+        .dfa = source->dfa,
+        .crlf = source->crlf,
+        .utf_checked = source->utf_checked,
+        .invalid_utf = source->invalid_utf,
+        .match_limit = source->match_limit,
+        .depth_limit = source->depth_limit,
+        .heap_limit = source->heap_limit,
+    };
+    if ( !(matcher->spans = calloc(matcher->group_count, sizeof(*matcher->spans))))
+        return 0;
+    if (matcher->engine == MATCHER_ENGINE_AHO_CORASICK)
+        return (matcher->pattern_ends = calloc(matcher->pattern_count, sizeof(*matcher->pattern_ends))) != NULL;
+    if (matcher->engine == MATCHER_ENGINE_SET) {
+        matcher->current = matcher->pattern_count;
+        matcher->range_end = matcher->subject_length;
+        matcher->matchers = calloc(matcher->pattern_count, sizeof(*matcher->matchers));
+        if (!matcher->matchers)
+            return 0;
+        for (i = 0; i < matcher->pattern_count; i++) {
+            if (!matcher_init_shared(&matcher->matchers[i], &source->matchers[i], general_context))
+                return 0;
+        }
+        return 1;
+    }
+    if (matcher->engine != MATCHER_ENGINE_PCRE2)
+        return 1;
+    return matcher_init_match_state(matcher);
 }
 
 void matcher_deinit(Matcher *matcher) {
+    size_t i;
+
+    if (!matcher->shared_code) {
+        if (matcher->engine == MATCHER_ENGINE_LITERAL)
+            literal_deinit(&matcher->literal);
+        else if (matcher->engine == MATCHER_ENGINE_AHO_CORASICK)
+            aho_corasick_deinit(&matcher->aho_corasick);
+        free(matcher->groups);
+    }
+    free(matcher->spans);
+    free(matcher->pattern_ends);
+    free(matcher->dfa_workspace);
+    // shared matchers of a set own their array, the code is shared per pattern
+    if (matcher->matchers) {
+        for (i = 0; i < matcher->pattern_count; i++)
+            matcher_deinit(&matcher->matchers[i]);
+        free(matcher->matchers);
+    }
     if (matcher->re_code) {
         pcre2_match_context_free(matcher->match_context);
+        pcre2_jit_stack_free(matcher->jit_stack);
         pcre2_match_data_free(matcher->match_data);
-        pcre2_code_free(matcher->re_code);
+        if (!matcher->shared_code)
+            pcre2_code_free(matcher->re_code);
+    }
+}
+
+// Recompile the patterns with PCRE2_MATCH_INVALID_UTF. Code that is shared
+// can't be replaced, so this must be done before. The DFA doesn't support it.
+static int matcher_allow_invalid_utf(Matcher *matcher, const MatcherOptions *options) {
+    MatcherOptions invalid_options = *options;
+    size_t i;
+
+    if (matcher->engine == MATCHER_ENGINE_SET) {
+        for (i = 0; i < matcher->pattern_count; i++) {
+            if (!matcher_allow_invalid_utf(&matcher->matchers[i], options)) {
+                matcher->error_pattern = i;
+                matcher->error_code = matcher->matchers[i].error_code;
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (matcher->engine != MATCHER_ENGINE_PCRE2 || matcher->invalid_utf)
+        return 1;
+    if (matcher->dfa) {
+        matcher->error_code = PCRE2_ERROR_DFA_UINVALID_UTF;
+        return 0;
+    }
+
+    invalid_options.invalid_utf = 1;
+    pcre2_code_free(matcher->re_code);
+    matcher->re_code = NULL;
+    if (!matcher_compile(matcher, &invalid_options))
+        return 0;
+    matcher->invalid_utf = 1;
+    matcher->jit_pending = 1;
+    return 1;
+}
+
+// In UTF mode, validate the whole subject once, so PCRE2 doesn't validate the
+// rest of it on every match. Patterns are compiled for valid
+// UTF-8 until a subject has invalid sequences, then they're compiled again for
+// invalid UTF-8, for good. Sets *out_invalid_offset to the offset of the
+// first invalid sequence, the subject length if there are none. Returns 0 if
+// compiling failed.
+int matcher_check_utf(Matcher *matcher, const MatcherOptions *options, PCRE2_SIZE *out_invalid_offset) {
+    *out_invalid_offset = matcher->subject_length;
+    if (!options->utf || matcher->engine == MATCHER_ENGINE_LITERAL
+        || matcher->engine == MATCHER_ENGINE_AHO_CORASICK)
+    {
+        return 1;
+    }
+
+    *out_invalid_offset = simd_utf8_valid_length(matcher->subject, matcher->subject_length);
+    matcher->utf_checked = (*out_invalid_offset == matcher->subject_length);
+    return matcher->utf_checked || matcher_allow_invalid_utf(matcher, options);
+}
+
+// Point the matcher to a new subject (e.g. the next chunk of a stream) and
+// restart matching from its beginning. In UTF mode, it must be checked again.
+void matcher_set_subject(Matcher *matcher, PCRE2_SPTR subject, PCRE2_SIZE subject_length) {
+    matcher->subject = subject;
+    matcher->subject_length = subject_length;
+    matcher->offset = 0;
+    matcher->empty_match = 0;
+    matcher->utf_checked = 0;
+    matcher->line_by_line = 0;
+    matcher->cursor = AHO_CORASICK_CURSOR_INIT;
+    if (matcher->pattern_ends)
+        memset(matcher->pattern_ends, 0, matcher->pattern_count * sizeof(*matcher->pattern_ends));
+    matcher->window_start = matcher->window_end = 0;
+    matcher->range_end = subject_length;
+    matcher->current = matcher->pattern_count;
+}
+
+// Restrict matching to [start, end) of the current subject. Text before "start"
+// is still visible to lookbehind assertions.
+void matcher_set_range(Matcher *matcher, PCRE2_SIZE start, PCRE2_SIZE end) {
+    matcher->subject_length = end;
+    matcher->offset = start;
+    matcher->empty_match = 0;
+    matcher->line_by_line = 0;
+    matcher->cursor = AHO_CORASICK_CURSOR_INIT;
+    if (matcher->pattern_ends)
+        memset(matcher->pattern_ends, 0, matcher->pattern_count * sizeof(*matcher->pattern_ends));
+    matcher->window_start = matcher->window_end = start;
+    matcher->range_end = end;
+    matcher->current = matcher->pattern_count;
+}
+
+// Find the next line with the prefilter's literal and set [start, end) to the
+// part of it that is after the offset. For a first literal, matches can only
+// start at the literal itself.
+static int matcher_next_candidate(Matcher *matcher, PCRE2_SIZE *start, PCRE2_SIZE *end) {
+    const uint8_t *subject = matcher->subject, *hit, *newline;
+    const PCRE2_SIZE offset = matcher->offset, length = matcher->subject_length;
+
+    if (offset >= length)
+        return 0;
+    hit = simd_memchr2(subject + offset, length - offset,
+                       matcher->prefilter_units[0], matcher->prefilter_units[1]);
+    if (!hit)
+        return 0;
+
+    if (matcher->prefilter == MATCHER_PREFILTER_FIRST) {
+        *start = (PCRE2_SIZE)(hit - subject);
+    } else {
+        newline = simd_memrchr(subject + offset, (size_t)(hit - subject) - offset, '\n');
+        *start = newline ? (PCRE2_SIZE)(newline - subject) + 1 : offset;
+    }
+    newline = memchr(hit, '\n', length - (size_t)(hit - subject));
+    *end = newline ? (PCRE2_SIZE)(newline - subject) + 1 : length;
+
+    matcher->prefilter_candidates++;
+    matcher->prefilter_skipped += *start - offset;
+    if (!matcher->dfa && matcher->prefilter_candidates % REGEXP_PREFILTER_CHECK_INTERVAL == 0
+        && matcher->prefilter_skipped < matcher->prefilter_candidates * REGEXP_PREFILTER_MIN_SKIP)
+    {
+        matcher->prefilter = MATCHER_PREFILTER_NONE;
+    }
+    return 1;
+}
+
+// Record the spans of the groups to extract from the last PCRE2 match, "rc"
+// being its return code. Groups that didn't take part (e.g. in "(a)?b") are
+// empty, a match where none of them did is skipped by returning 0.
+static int matcher_set_spans(Matcher *matcher, uint32_t rc) {
+    const PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(matcher->match_data);
+    uint32_t group;
+    size_t i;
+    int any = 0;
+
+    matcher->match_start = ovector[0];
+    matcher->match_end = matcher->offset = ovector[1];
+    matcher->empty_match = (ovector[0] == ovector[1]);
+    for (i = 0; i < matcher->group_count; i++) {
+        group = matcher->groups[i];
+        if (group < rc && ovector[group * 2] != PCRE2_UNSET) {
+            matcher->spans[i] = (MatcherSpan){
+                .start = matcher->subject + ovector[group * 2],
+                .length = ovector[group * 2 + 1] - ovector[group * 2],
+            };
+            any = 1;
+        } else {
+            matcher->spans[i] = (MatcherSpan){ .start = matcher->subject + ovector[0], .length = 0 };
+        }
+    }
+    return any;
+}
+
+// Replace the JIT stack with one that can grow twice as big. Returns 0 if it's
+// already as big as it may get or memory allocation failed.
+static int matcher_grow_jit_stack(Matcher *matcher) {
+    pcre2_jit_stack *jit_stack;
+
+    if (matcher->jit_stack_size >= REGEXP_PCRE2_JIT_STACK_LIMIT_SIZE)
+        return 0;
+    jit_stack = pcre2_jit_stack_create(REGEXP_PCRE2_JIT_STACK_START_SIZE, matcher->jit_stack_size << 1,
+                                       matcher->general_context);
+    if (!jit_stack)
+        return 0;
+    pcre2_jit_stack_assign(matcher->match_context, NULL, jit_stack);
+    pcre2_jit_stack_free(matcher->jit_stack);
+    matcher->jit_stack = jit_stack;
+    matcher->jit_stack_size <<= 1;
+    return 1;
+}
+
+// Match [start, length) of the subject with the matcher's engine and PCRE2's
+// match "options". A match that runs out of JIT stack or DFA workspace is
+// retried with more. Only the longest of the DFA matches at a position is
+// kept, a return code of 0 (not enough room for all of them) is fine.
+static int matcher_match(Matcher *matcher, PCRE2_SIZE length, PCRE2_SIZE start, uint32_t options) {
+    int *workspace;
+    int rc;
+
+    if (matcher->utf_checked)
+        options |= PCRE2_NO_UTF_CHECK;
+    if (!matcher->dfa) {
+        for (;;) {
+            rc = pcre2_match(matcher->re_code, matcher->subject, length, start, options,
+                             matcher->match_data, matcher->match_context);
+            if (rc != PCRE2_ERROR_JIT_STACKLIMIT || !matcher_grow_jit_stack(matcher))
+                return rc;
+        }
+    }
+    for (;;) {
+        rc = pcre2_dfa_match(matcher->re_code, matcher->subject, length, start, options,
+                             matcher->match_data, matcher->match_context,
+                             matcher->dfa_workspace, matcher->dfa_workspace_size);
+        if (rc != PCRE2_ERROR_DFA_WSSIZE || matcher->dfa_workspace_size >= REGEXP_DFA_WORKSPACE_MAX_SIZE)
+            return (rc == 0) ? 1 : rc;
+        workspace = realloc(matcher->dfa_workspace, (matcher->dfa_workspace_size << 1) * sizeof(*workspace));
+        if (!workspace)
+            return PCRE2_ERROR_NOMEMORY;
+        matcher->dfa_workspace = workspace;
+        matcher->dfa_workspace_size <<= 1;
+    }
+}
+
+// The budget a failed match went over, -1 if it failed for another reason.
+static int matcher_skip_reason(int rc) {
+    switch (rc) {
+    case PCRE2_ERROR_MATCHLIMIT:
+        return MATCHER_SKIP_MATCH_LIMIT;
+    case PCRE2_ERROR_DEPTHLIMIT:
+    case PCRE2_ERROR_DFA_RECURSE:
+        return MATCHER_SKIP_DEPTH_LIMIT;
+    case PCRE2_ERROR_HEAPLIMIT:
+        return MATCHER_SKIP_HEAP_LIMIT;
+    case PCRE2_ERROR_JIT_STACKLIMIT:
+        return MATCHER_SKIP_JIT_STACK;
+    case PCRE2_ERROR_DFA_WSSIZE:
+        return MATCHER_SKIP_DFA_WORKSPACE;
+    default:
+        return -1;
+    }
+}
+
+// Set [start, end) to the part of the line at the offset that is after it.
+static void matcher_next_line(const Matcher *matcher, PCRE2_SIZE *start, PCRE2_SIZE *end) {
+    const uint8_t *newline;
+
+    *start = matcher->offset;
+    newline = memchr(matcher->subject + *start, '\n', matcher->subject_length - *start);
+    *end = newline ? (PCRE2_SIZE)(newline - matcher->subject) + 1 : matcher->subject_length;
+}
+
+// After an empty match at the offset, find the next match the way Perl does:
+// a non-empty one at the offset, else any one from the next character on.
+// Returns 0 with the options to match with next, or the return code of a match
+// that already settled it.
+//
+// An unanchored PCRE2_NOTEMPTY_ATSTART match does it all in one call and keeps
+// the JIT, PCRE2 itself steps over whole UTF-8 characters. Only at a CR LF the
+// offset must not stop between the two: a non-empty match is tried anchored at
+// the offset, then the offset skips the pair.
+static int matcher_skip_empty_match(Matcher *matcher, uint32_t *options_out) {
+    const PCRE2_SIZE offset = matcher->offset;
+    PCRE2_SIZE start, end = matcher->subject_length;
+    int rc;
+
+    matcher->empty_match = 0;
+    *options_out = 0;
+    if (!matcher->crlf || offset + 1 >= matcher->subject_length
+        || matcher->subject[offset] != '\r' || matcher->subject[offset + 1] != '\n')
+    {
+        *options_out = PCRE2_NOTEMPTY_ATSTART;
+        return 0;
+    }
+
+    if (matcher->line_by_line)
+        matcher_next_line(matcher, &start, &end);
+    rc = matcher_match(matcher, end, offset, PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED);
+    // a budget the retry went over is hit again, and dealt with, from the LF
+    if (rc >= 0 || (rc != PCRE2_ERROR_NOMATCH && matcher_skip_reason(rc) < 0))
+        return rc;
+    matcher->offset = offset + 2;
+    return 0;
+}
+
+// Run PCRE2 on the candidate lines only. Since no match can span lines, ending
+// the subject at the end of the line changes nothing but the amount of text
+// PCRE2 looks at when the line has no match.
+//
+// A line that goes over a budget is skipped and counted. Without the
+// prefilter, the line at fault is unknown when a match fails that way, so
+// lines are matched one at a time until it's found. Matches of patterns that
+// span lines are missed until then.
+static int matcher_match_prefiltered(Matcher *matcher) {
+    PCRE2_SIZE start, end;
+    uint32_t options = 0;
+    int rc, reason;
+
+    if (matcher->jit_pending && matcher->subject_length - matcher->offset >= REGEXP_JIT_MIN_SUBJECT_SIZE) {
+        pcre2_jit_compile(matcher->re_code, REGEXP_PCRE2_JIT_OPTIONS);
+        matcher->jit_pending = 0;
+    }
+    if (matcher->empty_match && (rc = matcher_skip_empty_match(matcher, &options)) != 0)
+        return rc;
+
+    for (;;) {
+        if (matcher->prefilter != MATCHER_PREFILTER_NONE) {
+            if (!matcher_next_candidate(matcher, &start, &end)) {
+                matcher->offset = matcher->subject_length;
+                return PCRE2_ERROR_NOMATCH;
+            }
+        } else if (matcher->line_by_line) {
+            if (matcher->offset >= matcher->subject_length)
+                return PCRE2_ERROR_NOMATCH;
+            matcher_next_line(matcher, &start, &end);
+        } else {
+            rc = matcher_match(matcher, matcher->subject_length, matcher->offset, options);
+            if (matcher_skip_reason(rc) < 0)
+                return rc;
+            matcher->line_by_line = 1;
+            continue;
+        }
+
+        rc = matcher_match(matcher, end, start, (start == matcher->offset) ? options : 0);
+        if ((reason = matcher_skip_reason(rc)) >= 0) {
+            matcher->skipped_lines[reason]++;
+            matcher->line_by_line = 0;
+        } else if (rc != PCRE2_ERROR_NOMATCH) {
+            return rc;
+        }
+        matcher->offset = end;
+        options = 0;
+    }
+}
+
+// Matches of fixed strings only have group 0, the whole match.
+static void matcher_set_whole_spans(Matcher *matcher,
+                                    PCRE2_SPTR *out_substring_start,
+                                    PCRE2_SIZE *out_substring_length)
+{
+    size_t i;
+
+    for (i = 0; i < matcher->group_count; i++) {
+        matcher->spans[i] = (MatcherSpan){
+            .start = matcher->subject + matcher->match_start,
+            .length = matcher->match_end - matcher->match_start,
+        };
+    }
+    *out_substring_start = matcher->spans[0].start;
+    *out_substring_length = matcher->spans[0].length;
+}
+
+static int matcher_next_literal(Matcher *matcher,
+                                PCRE2_SPTR *out_substring_start,
+                                PCRE2_SIZE *out_substring_length)
+{
+    const uint8_t *hit = NULL;
+
+    if (matcher->offset < matcher->subject_length) {
+        hit = literal_find(&matcher->literal, matcher->subject + matcher->offset,
+                           matcher->subject_length - matcher->offset);
+    }
+    if (!hit) {
+        matcher->offset = matcher->subject_length;
+        return 0;
+    }
+
+    matcher->match_start = (PCRE2_SIZE)(hit - matcher->subject);
+    matcher->match_end = matcher->offset = matcher->match_start + matcher->literal.length;
+    matcher_set_whole_spans(matcher, out_substring_start, out_substring_length);
+    return 1;
+}
+
+// Overlapping occurrences of different strings are all reported. Those of the
+// same string are not, like the other engines its matches follow each other.
+static int matcher_next_aho_corasick(Matcher *matcher,
+                                     PCRE2_SPTR *out_substring_start,
+                                     PCRE2_SIZE *out_substring_length)
+{
+    size_t start, index;
+
+    do {
+        if (!aho_corasick_next(&matcher->aho_corasick, &matcher->cursor, matcher->subject,
+                               &matcher->offset, matcher->subject_length, &start, &index))
+        {
+            return 0;
+        }
+    } while (start < matcher->pattern_ends[index]);
+    matcher->pattern_ends[index] = matcher->offset;
+
+    matcher->match_start = start;
+    matcher->match_end = matcher->offset;
+    matcher->pattern_index = index;
+    matcher_set_whole_spans(matcher, out_substring_start, out_substring_length);
+    return 1;
+}
+
+// Point the current matcher of a set to the current window.
+static void matcher_start_window(Matcher *matcher) {
+    Matcher *current = &matcher->matchers[matcher->current];
+
+    current->subject = matcher->subject;
+    current->utf_checked = matcher->utf_checked;
+    matcher_set_range(current, matcher->window_start, matcher->window_end);
+}
+
+// Windows end at a line boundary, like parallel chunks. A set with patterns
+// that can match across lines has a single window, the whole range.
+static PCRE2_SIZE matcher_window_end(const Matcher *matcher, PCRE2_SIZE start) {
+    const uint8_t *newline;
+
+    if (!matcher->line_local || matcher->range_end - start <= REGEXP_WINDOW_SIZE)
+        return matcher->range_end;
+    newline = memchr(matcher->subject + start + REGEXP_WINDOW_SIZE, '\n',
+                     matcher->range_end - start - REGEXP_WINDOW_SIZE);
+    return newline ? (PCRE2_SIZE)(newline - matcher->subject) + 1 : matcher->range_end;
+}
+
+// Move to the window after the current one, returns 0 at the end of the range.
+// With a shared prefilter, a window starts at the next line with a literal of
+// the set and ends at the first REGEXP_SET_PREFILTER_GAP bytes without any.
+static int matcher_next_window(Matcher *matcher) {
+    const SimdByteSet *units = &matcher->set_units;
+    const uint8_t *subject = matcher->subject, *hit, *newline;
+    const PCRE2_SIZE range_end = matcher->range_end;
+    PCRE2_SIZE start = matcher->window_end, end, gap;
+
+    if (start >= range_end)
+        return 0;
+    if (units->count == 0) {
+        matcher->window_start = start;
+        matcher->window_end = matcher_window_end(matcher, start);
+        return 1;
+    }
+
+    if ( !(hit = simd_byte_set_find(units, subject + start, range_end - start))) {
+        matcher->window_start = matcher->window_end = range_end;
+        return 0;
+    }
+    newline = simd_memrchr(subject + start, (size_t)(hit - subject) - start, '\n');
+    start = newline ? (PCRE2_SIZE)(newline - subject) + 1 : start;
+    end = (PCRE2_SIZE)(hit - subject);
+
+    for (;;) {
+        newline = memchr(subject + end, '\n', range_end - end);
+        end = newline ? (PCRE2_SIZE)(newline - subject) + 1 : range_end;
+        gap = (range_end - end < REGEXP_SET_PREFILTER_GAP) ? range_end - end : REGEXP_SET_PREFILTER_GAP;
+        if (gap == 0 || end - start >= REGEXP_WINDOW_SIZE || !simd_byte_set_find(units, subject + end, gap))
+            break;
+        // the window takes the whole gap, up to the end of its last line
+        end += gap - 1;
+    }
+
+    matcher->window_start = start;
+    matcher->window_end = end;
+    return 1;
+}
+
+int matcher_next(Matcher *matcher, PCRE2_SPTR *out_substring_start, PCRE2_SIZE *out_substring_length);
+
+// Report the matches of every pattern in the window, then move to the next one.
+static int matcher_next_set(Matcher *matcher,
+                            PCRE2_SPTR *out_substring_start,
+                            PCRE2_SIZE *out_substring_length)
+{
+    for (;;) {
+        if (matcher->current < matcher->pattern_count) {
+            Matcher *current = &matcher->matchers[matcher->current];
+            if (matcher_next(current, out_substring_start, out_substring_length)) {
+                matcher->pattern_index = matcher->current;
+                matcher->match_start = current->match_start;
+                matcher->match_end = current->match_end;
+                memcpy(matcher->spans, current->spans, matcher->group_count * sizeof(*matcher->spans));
+                return 1;
+            }
+            if (current->match_error) {
+                matcher->match_error = current->match_error;
+                return 0;
+            }
+            if (++matcher->current < matcher->pattern_count)
+                matcher_start_window(matcher);
+            continue;
+        }
+
+        if (!matcher_next_window(matcher))
+            return 0;
+        matcher->current = 0;
+        matcher_start_window(matcher);
     }
 }
 
@@ -59,26 +1212,72 @@ int matcher_next(Matcher *matcher,
                  PCRE2_SPTR *out_substring_start,
                  PCRE2_SIZE *out_substring_length)
 {
-    int rc = pcre2_match(
-        matcher->re_code,
-        matcher->subject,
-        matcher->subject_length,
-        matcher->offset,
-        0,
-        matcher->match_data,
-        matcher->match_context
-    );
-    if (rc < 0)
-        return 0;
-
-    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(matcher->match_data);
-    *out_substring_start = matcher->subject + ovector[0];
-    *out_substring_length = ovector[1] - ovector[0];
-    matcher->offset = ovector[1];
+    if (matcher->engine == MATCHER_ENGINE_LITERAL)
+        return matcher_next_literal(matcher, out_substring_start, out_substring_length);
+    if (matcher->engine == MATCHER_ENGINE_AHO_CORASICK)
+        return matcher_next_aho_corasick(matcher, out_substring_start, out_substring_length);
+    if (matcher->engine == MATCHER_ENGINE_SET)
+        return matcher_next_set(matcher, out_substring_start, out_substring_length);
+
+    int rc;
 
+    do {
+        if ((rc = matcher_match_prefiltered(matcher)) < 0) {
+            if (rc != PCRE2_ERROR_NOMATCH)
+                matcher->match_error = rc;
+            return 0;
+        }
+    } while (!matcher_set_spans(matcher, (uint32_t)rc));
+
+    *out_substring_start = matcher->spans[0].start;
+    *out_substring_length = matcher->spans[0].length;
     return 1;
 }
 
+// Offsets in the subject of the whole last match, e.g. to tell its line or
+// where it is in the input.
+void matcher_match_offsets(const Matcher *matcher, PCRE2_SIZE *out_start, PCRE2_SIZE *out_end) {
+    *out_start = matcher->match_start;
+    *out_end = matcher->match_end;
+}
+
+// Add the lines the matcher (and every matcher of its set) skipped to
+// "skipped_lines", by reason.
+void matcher_add_skipped_lines(const Matcher *matcher, size_t *skipped_lines) {
+    size_t i;
+
+    for (i = 0; i < MATCHER_SKIP_REASON_COUNT; i++)
+        skipped_lines[i] += matcher->skipped_lines[i];
+    if (matcher->engine == MATCHER_ENGINE_SET) {
+        for (i = 0; i < matcher->pattern_count; i++)
+            matcher_add_skipped_lines(&matcher->matchers[i], skipped_lines);
+    }
+}
+
+// Find the line around [match_start, match_end) of "subject", without its
+// newline. A match that spans lines (with --dotall) gives all of them.
+void matcher_line_bounds(PCRE2_SPTR subject,
+                         PCRE2_SIZE subject_length,
+                         PCRE2_SIZE match_start,
+                         PCRE2_SIZE match_end,
+                         PCRE2_SPTR *out_line_start,
+                         PCRE2_SIZE *out_line_length)
+{
+    const uint8_t *newline;
+    PCRE2_SIZE end;
+
+    newline = simd_memrchr(subject, match_start, '\n');
+    *out_line_start = newline ? newline + 1 : subject;
+    // a match that ends with its newline belongs to that line
+    if (match_end > match_start && subject[match_end - 1] == '\n')
+        end = match_end - 1;
+    else if ( !(newline = memchr(subject + match_end, '\n', subject_length - match_end)))
+        end = subject_length;
+    else
+        end = (PCRE2_SIZE)(newline - subject);
+    *out_line_length = (PCRE2_SIZE)(subject + end - *out_line_start);
+}
+
 void matcher_error_info(Matcher *matcher,
                         PCRE2_UCHAR *out_error_buffer,
                         PCRE2_SIZE error_buffer_length)
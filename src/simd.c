@@ -0,0 +1,363 @@
+// Byte searches used to skip input that can't match, and UTF-8 validation.
+// They compare 16 bytes at a time with SSE2 and fall back to plain loops
+// elsewhere. SIMD_HAVE_AVX2 is set by build.c when AVX2 code can be compiled,
+// whether the CPU supports it is checked at runtime.
+
+#define SIMD_WIDTH 16
+// the most bytes a SimdByteSet holds
+#define SIMD_MAX_BYTES 16
+
+static inline int simd_bit_index(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+static inline int simd_last_bit_index(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 31 - __builtin_clz(mask);
+#else
+    int i = 31;
+    while (!(mask & (1u << i)))
+        i--;
+    return i;
+#endif
+}
+
+// Find the first byte equal to "a" or "b", e.g. both cases of a letter.
+const uint8_t *simd_memchr2(const uint8_t *p, size_t size, uint8_t a, uint8_t b) {
+    const uint8_t *end = p + size;
+
+    if (a == b)
+        return memchr(p, a, size);
+
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+    __m128i chunk;
+    uint32_t mask;
+
+    for (; p + SIMD_WIDTH <= end; p += SIMD_WIDTH) {
+        chunk = _mm_loadu_si128((const __m128i *)p);
+        mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                                        _mm_cmpeq_epi8(chunk, vb)));
+        if (mask)
+            return p + simd_bit_index(mask);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b)
+            return p;
+    }
+    return NULL;
+}
+
+// A set of up to SIMD_MAX_BYTES bytes to search for. With AVX2, any byte is
+// looked up in a bitmap of the set indexed by its nibbles, 32 at a time.
+typedef struct {
+    uint8_t bytes[SIMD_MAX_BYTES];
+    size_t count;
+    // bit (b >> 4) & 7 of nibbles[b >> 7][b & 15] is set for every byte b
+    uint8_t nibbles[2][16];
+    int avx2;
+} SimdByteSet;
+
+void simd_byte_set_init(SimdByteSet *set) {
+    *set = (SimdByteSet){ 0 };
+#if SIMD_HAVE_AVX2
+    set->avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+}
+
+// Add "byte" to the set. Returns 0 if the set is full.
+int simd_byte_set_add(SimdByteSet *set, uint8_t byte) {
+    if (memchr(set->bytes, byte, set->count))
+        return 1;
+    if (set->count == SIMD_MAX_BYTES)
+        return 0;
+    set->bytes[set->count++] = byte;
+    set->nibbles[byte >> 7][byte & 15] |= (uint8_t)(1u << ((byte >> 4) & 7));
+    return 1;
+}
+
+#if SIMD_HAVE_AVX2
+// Bytes in [*p, end) are checked 32 at a time, *p is left at the first one
+// that wasn't checked. pshufb gives 0 for an index with the high bit set, so
+// each byte is only looked up in the bitmap row of its half of the range.
+__attribute__((target("avx2")))
+static const uint8_t *simd_byte_set_find_avx2(const SimdByteSet *set, const uint8_t **p, const uint8_t *end) {
+    const __m256i low_rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->nibbles[0]));
+    const __m256i high_rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->nibbles[1]));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i index_mask = _mm256_set1_epi8((char)0x8f), high_bit = _mm256_set1_epi8((char)0x80);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    const uint8_t *s = *p;
+    __m256i v, index, rows, bit;
+    uint32_t mask;
+
+    for (; s + 32 <= end; s += 32) {
+        v = _mm256_loadu_si256((const __m256i *)s);
+        index = _mm256_and_si256(v, index_mask);
+        rows = _mm256_or_si256(_mm256_shuffle_epi8(low_rows, index),
+                               _mm256_shuffle_epi8(high_rows, _mm256_xor_si256(index, high_bit)));
+        bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble_mask));
+        mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(rows, bit), bit));
+        if (mask)
+            return s + simd_bit_index(mask);
+    }
+    *p = s;
+    return NULL;
+}
+#endif
+
+// Find the first byte of [p, p + size) that is in the set.
+const uint8_t *simd_byte_set_find(const SimdByteSet *set, const uint8_t *p, size_t size) {
+    const uint8_t *end = p + size;
+
+    if (set->count <= 2)
+        return simd_memchr2(p, size, set->bytes[0], set->bytes[set->count - 1]);
+
+#if SIMD_HAVE_AVX2
+    const uint8_t *hit;
+
+    if (set->avx2 && (hit = simd_byte_set_find_avx2(set, &p, end)))
+        return hit;
+#endif
+#if defined(__SSE2__)
+    __m128i v[SIMD_MAX_BYTES], chunk, eq;
+    uint32_t mask;
+    size_t i;
+
+    for (i = 0; i < set->count; i++)
+        v[i] = _mm_set1_epi8((char)set->bytes[i]);
+    for (; p + SIMD_WIDTH <= end; p += SIMD_WIDTH) {
+        chunk = _mm_loadu_si128((const __m128i *)p);
+        eq = _mm_cmpeq_epi8(chunk, v[0]);
+        for (i = 1; i < set->count; i++)
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi8(chunk, v[i]));
+        mask = (uint32_t)_mm_movemask_epi8(eq);
+        if (mask)
+            return p + simd_bit_index(mask);
+    }
+#endif
+    for (; p < end; p++) {
+        if (set->nibbles[*p >> 7][*p & 15] & (1u << ((*p >> 4) & 7)))
+            return p;
+    }
+    return NULL;
+}
+
+// Find the last "byte" of [p, p + size).
+const uint8_t *simd_memrchr(const uint8_t *p, size_t size, uint8_t byte) {
+    const uint8_t *end = p + size;
+
+#if defined(__SSE2__)
+    const __m128i v = _mm_set1_epi8((char)byte);
+    uint32_t mask;
+
+    for (; end - p >= SIMD_WIDTH; end -= SIMD_WIDTH) {
+        mask = (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(end - SIMD_WIDTH)), v));
+        if (mask)
+            return end - SIMD_WIDTH + simd_last_bit_index(mask);
+    }
+#endif
+    while (end > p) {
+        if (*--end == byte)
+            return end;
+    }
+    return NULL;
+}
+
+// Length of the valid sequence at p[0], 0 if it isn't one. Overlong forms,
+// surrogates and code points above U+10FFFF are invalid, like PCRE2 has them.
+static size_t simd_utf8_sequence_length(const uint8_t *p, size_t size) {
+    uint8_t lo = 0x80, hi = 0xbf;
+    size_t length, i;
+
+    if (p[0] < 0x80)
+        return 1;
+    if (p[0] >= 0xc2 && p[0] <= 0xdf)
+        length = 2;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef)
+        length = 3;
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+        length = 4;
+    else
+        return 0;
+    if (p[0] == 0xe0)
+        lo = 0xa0;
+    else if (p[0] == 0xed)
+        hi = 0x9f;
+    else if (p[0] == 0xf0)
+        lo = 0x90;
+    else if (p[0] == 0xf4)
+        hi = 0x8f;
+
+    if (size < length || p[1] < lo || p[1] > hi)
+        return 0;
+    for (i = 2; i < length; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    }
+    return length;
+}
+
+// Validate [p + start, end) a sequence at a time, skipping ASCII 16 bytes at a
+// time. Returns the offset from p of the first invalid sequence, or of end.
+static size_t simd_utf8_validate_from(const uint8_t *p, size_t start, size_t end) {
+    size_t i = start, length;
+
+    while (i < end) {
+#if defined(__SSE2__)
+        while (i + SIMD_WIDTH <= end && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i))))
+            i += SIMD_WIDTH;
+        if (i >= end)
+            break;
+#endif
+        if ( !(length = simd_utf8_sequence_length(p + i, end - i)))
+            return i;
+        i += length;
+    }
+    return end;
+}
+
+#if SIMD_HAVE_AVX2
+// The lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte": the high and low nibbles of each byte and the high
+// nibble of the next one index three tables of the errors the pair may be part
+// of, a pair is invalid if the three agree on one. Continuations of 3 and 4
+// byte sequences are checked against the bytes 2 and 3 positions back.
+enum {
+    SIMD_UTF8_TOO_SHORT = 1 << 0,
+    SIMD_UTF8_TOO_LONG = 1 << 1,
+    SIMD_UTF8_OVERLONG_3 = 1 << 2,
+    SIMD_UTF8_TOO_LARGE = 1 << 3,
+    SIMD_UTF8_SURROGATE = 1 << 4,
+    SIMD_UTF8_OVERLONG_2 = 1 << 5,
+    SIMD_UTF8_TOO_LARGE_1000 = 1 << 6,
+    SIMD_UTF8_OVERLONG_4 = 1 << 6,
+    SIMD_UTF8_TWO_CONTS = 1 << 7,
+    SIMD_UTF8_CARRY = SIMD_UTF8_TOO_SHORT | SIMD_UTF8_TOO_LONG | SIMD_UTF8_TWO_CONTS,
+};
+
+#define SIMD_UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// The bytes of "input" shifted "n" positions later, the first ones taken from
+// the end of "previous".
+#define SIMD_UTF8_PREVIOUS(input, previous, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((previous), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i simd_utf8_high_nibbles(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+// Check [p + *start, end) 32 bytes at a time, up to the first block with an
+// error. *start is left at the start of the sequence the last valid block ends
+// in, the rest is for simd_utf8_validate_from.
+__attribute__((target("avx2")))
+static void simd_utf8_validate_avx2(const uint8_t *p, size_t *start, size_t end) {
+    const __m256i byte_1_high = SIMD_UTF8_TABLE(
+        // ASCII
+        SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG,
+        SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG, SIMD_UTF8_TOO_LONG,
+        // continuations
+        SIMD_UTF8_TWO_CONTS, SIMD_UTF8_TWO_CONTS, SIMD_UTF8_TWO_CONTS, SIMD_UTF8_TWO_CONTS,
+        // leads of 2, 3 and 4 byte sequences
+        SIMD_UTF8_TOO_SHORT | SIMD_UTF8_OVERLONG_2,
+        SIMD_UTF8_TOO_SHORT,
+        SIMD_UTF8_TOO_SHORT | SIMD_UTF8_OVERLONG_3 | SIMD_UTF8_SURROGATE,
+        SIMD_UTF8_TOO_SHORT | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000 | SIMD_UTF8_OVERLONG_4);
+    const __m256i byte_1_low = SIMD_UTF8_TABLE(
+        SIMD_UTF8_CARRY | SIMD_UTF8_OVERLONG_3 | SIMD_UTF8_OVERLONG_2 | SIMD_UTF8_OVERLONG_4,
+        SIMD_UTF8_CARRY | SIMD_UTF8_OVERLONG_2,
+        SIMD_UTF8_CARRY,
+        SIMD_UTF8_CARRY,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000 | SIMD_UTF8_SURROGATE,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000,
+        SIMD_UTF8_CARRY | SIMD_UTF8_TOO_LARGE | SIMD_UTF8_TOO_LARGE_1000);
+    const __m256i byte_2_high = SIMD_UTF8_TABLE(
+        // ASCII
+        SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT,
+        SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT,
+        // continuations 0x80-0x8f, 0x90-0x9f, 0xa0-0xbf
+        SIMD_UTF8_TOO_LONG | SIMD_UTF8_OVERLONG_2 | SIMD_UTF8_TWO_CONTS | SIMD_UTF8_OVERLONG_3
+            | SIMD_UTF8_TOO_LARGE_1000 | SIMD_UTF8_OVERLONG_4,
+        SIMD_UTF8_TOO_LONG | SIMD_UTF8_OVERLONG_2 | SIMD_UTF8_TWO_CONTS | SIMD_UTF8_OVERLONG_3
+            | SIMD_UTF8_TOO_LARGE,
+        SIMD_UTF8_TOO_LONG | SIMD_UTF8_OVERLONG_2 | SIMD_UTF8_TWO_CONTS | SIMD_UTF8_SURROGATE
+            | SIMD_UTF8_TOO_LARGE,
+        SIMD_UTF8_TOO_LONG | SIMD_UTF8_OVERLONG_2 | SIMD_UTF8_TWO_CONTS | SIMD_UTF8_SURROGATE
+            | SIMD_UTF8_TOO_LARGE,
+        // leads
+        SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT, SIMD_UTF8_TOO_SHORT);
+    // greater than these in the last 3 bytes, a sequence goes on in the next block
+    const __m256i incomplete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    const __m256i third_byte = _mm256_set1_epi8((char)(0xe0 - 0x80));
+    const __m256i fourth_byte = _mm256_set1_epi8((char)(0xf0 - 0x80));
+    const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+    __m256i input, previous = _mm256_setzero_si256(), prev1, special, must23, error;
+    size_t i = *start;
+
+    for (; i + 32 <= end; i += 32) {
+        input = _mm256_loadu_si256((const __m256i *)(p + i));
+        if (!_mm256_movemask_epi8(input)) {
+            // ASCII can't follow a sequence that goes on
+            error = _mm256_subs_epu8(previous, incomplete);
+        } else {
+            prev1 = SIMD_UTF8_PREVIOUS(input, previous, 1);
+            special = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, simd_utf8_high_nibbles(prev1)),
+                                 _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+                _mm256_shuffle_epi8(byte_2_high, simd_utf8_high_nibbles(input)));
+            must23 = _mm256_or_si256(
+                _mm256_subs_epu8(SIMD_UTF8_PREVIOUS(input, previous, 2), third_byte),
+                _mm256_subs_epu8(SIMD_UTF8_PREVIOUS(input, previous, 3), fourth_byte));
+            error = _mm256_xor_si256(_mm256_and_si256(must23, high_bit), special);
+        }
+        if (!_mm256_testz_si256(error, error))
+            break;
+        previous = input;
+    }
+
+    // back up over the continuations and the lead of a sequence cut at i
+    *start = i;
+    while (*start > 0 && i - *start < 3 && (p[*start - 1] & 0xc0) == 0x80)
+        (*start)--;
+    if (*start > 0 && p[*start - 1] >= 0xc0)
+        (*start)--;
+}
+#endif
+
+// Length of the valid UTF-8 at the start of [p, p + size), "size" if all of it
+// is. The bulk of valid input is checked 32 bytes at a time with AVX2, invalid
+// sequences are pinpointed a sequence at a time.
+size_t simd_utf8_valid_length(const uint8_t *p, size_t size) {
+    size_t start = 0;
+
+#if SIMD_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        simd_utf8_validate_avx2(p, &start, size);
+#endif
+    return simd_utf8_validate_from(p, start, size);
+}
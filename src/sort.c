@@ -0,0 +1,244 @@
+// Sorts string set entries in byte order (the order of LC_ALL=C sort) with an
+// MSD radix sort. The byte of every key at the current depth is first copied to
+// a small "oracle" array, so the distribution passes don't chase the key
+// pointers more than once per level. Big inputs are split in buckets on the
+// calling thread and the buckets are sorted by worker threads.
+
+#define SORT_INSERTION_THRESHOLD 32
+#define SORT_BUCKETS 257
+
+static const size_t SORT_PARALLEL_THRESHOLD = 1 << 16;
+// buckets bigger than total / (jobs * SORT_TASKS_PER_JOB) are split further
+// before the workers start, so one big bucket doesn't keep a single thread busy
+static const size_t SORT_TASKS_PER_JOB = 8;
+
+typedef struct {
+    size_t start, count, depth;
+} SortTask;
+
+typedef struct {
+    StringSetEntry **entries, **tmp;
+    uint16_t *oracle;
+    SortTask *tasks;
+    size_t task_count;
+    atomic_size_t next_task;
+} SortScan;
+
+// 0 for the end of the key, byte + 1 otherwise, so shorter keys come first.
+static inline uint16_t sort_key_byte(const StringSetEntry *entry, size_t depth) {
+    return (depth < entry->length) ? (uint16_t)((const unsigned char *)entry->key)[depth] + 1 : 0;
+}
+
+static int sort_compare_from(const StringSetEntry *x, const StringSetEntry *y, size_t depth) {
+    size_t n = (x->length < y->length) ? x->length : y->length;
+    int res = (n > depth) ? memcmp(x->key + depth, y->key + depth, n - depth) : 0;
+    if (res != 0)
+        return res;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+static void sort_insertion(StringSetEntry **entries, size_t count, size_t depth) {
+    StringSetEntry *entry;
+    size_t i, j;
+
+    for (i = 1; i < count; i++) {
+        entry = entries[i];
+        for (j = i; j > 0 && sort_compare_from(entries[j - 1], entry, depth) > 0; j--)
+            entries[j] = entries[j - 1];
+        entries[j] = entry;
+    }
+}
+
+// Distribute the entries by their byte at "depth". Skips levels where all the
+// keys share the same byte. On return bucket b spans [starts[b], starts[b + 1])
+// and "depth" is the level that was used. Returns 0 if all the keys ended.
+static int sort_partition(StringSetEntry **entries,
+                          StringSetEntry **tmp,
+                          uint16_t *oracle,
+                          size_t count,
+                          size_t *depth,
+                          size_t starts[SORT_BUCKETS + 1])
+{
+    size_t counts[SORT_BUCKETS], positions[SORT_BUCKETS], i;
+    int b;
+
+    for (;;) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < count; i++) {
+            oracle[i] = sort_key_byte(entries[i], *depth);
+            counts[oracle[i]]++;
+        }
+        if (counts[oracle[0]] != count)
+            break;
+        if (oracle[0] == 0)
+            return 0;
+        // common prefix, nothing moves
+        (*depth)++;
+    }
+
+    starts[0] = 0;
+    for (b = 0; b < SORT_BUCKETS; b++) {
+        positions[b] = starts[b];
+        starts[b + 1] = starts[b] + counts[b];
+    }
+    for (i = 0; i < count; i++)
+        tmp[positions[oracle[i]]++] = entries[i];
+    memcpy(entries, tmp, count * sizeof(*entries));
+    return 1;
+}
+
+// Sort the entries whose keys are equal up to "depth". Only the smaller buckets
+// are sorted recursively and the largest one by the loop, so the recursion is
+// at most log2(count) deep however long the shared prefixes of the keys are.
+static void sort_msd(StringSetEntry **entries,
+                     StringSetEntry **tmp,
+                     uint16_t *oracle,
+                     size_t count,
+                     size_t depth)
+{
+    size_t starts[SORT_BUCKETS + 1], n;
+    int b, largest;
+
+    for (;;) {
+        if (count < SORT_INSERTION_THRESHOLD) {
+            sort_insertion(entries, count, depth);
+            return;
+        }
+        if (!sort_partition(entries, tmp, oracle, count, &depth, starts))
+            return;
+
+        // bucket 0 holds keys that ended at this depth, they are all equal
+        largest = 1;
+        for (b = 2; b < SORT_BUCKETS; b++) {
+            if (starts[b + 1] - starts[b] > starts[largest + 1] - starts[largest])
+                largest = b;
+        }
+        for (b = 1; b < SORT_BUCKETS; b++) {
+            n = starts[b + 1] - starts[b];
+            if (b != largest && n > 1)
+                sort_msd(entries + starts[b], tmp + starts[b], oracle + starts[b], n, depth + 1);
+        }
+
+        entries += starts[largest];
+        tmp += starts[largest];
+        oracle += starts[largest];
+        count = starts[largest + 1] - starts[largest];
+        depth++;
+    }
+}
+
+static void *sort_worker_run(void *arg) {
+    SortScan *scan = arg;
+    const SortTask *task;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&scan->next_task, 1)) < scan->task_count) {
+        task = &scan->tasks[i];
+        sort_msd(scan->entries + task->start, scan->tmp + task->start,
+                 scan->oracle + task->start, task->count, task->depth);
+    }
+    return NULL;
+}
+
+// Split the big tasks on the calling thread until every task is small enough
+// to be a fair share of the work of one worker.
+static int sort_split_tasks(SortScan *scan, size_t count, size_t jobs) {
+    const size_t limit = count / (jobs * SORT_TASKS_PER_JOB);
+    size_t starts[SORT_BUCKETS + 1], cap = SORT_BUCKETS, i = 0, depth, n;
+    SortTask task, *tmp;
+    int b;
+
+    scan->tasks = malloc(cap * sizeof(*scan->tasks));
+    if (!scan->tasks)
+        return 0;
+    scan->tasks[0] = (SortTask){ .start = 0, .count = count, .depth = 0 };
+    scan->task_count = 1;
+
+    // tasks at or after "i" are the ones that may still be too big
+    while (i < scan->task_count) {
+        task = scan->tasks[i];
+        if (task.count <= limit || task.count < SORT_INSERTION_THRESHOLD) {
+            i++;
+            continue;
+        }
+
+        // replace the task with its buckets
+        scan->tasks[i] = scan->tasks[--scan->task_count];
+        depth = task.depth;
+        if (!sort_partition(scan->entries + task.start, scan->tmp + task.start,
+                            scan->oracle + task.start, task.count, &depth, starts))
+        {
+            continue;
+        }
+
+        for (b = 1; b < SORT_BUCKETS; b++) {
+            n = starts[b + 1] - starts[b];
+            if (n < 2)
+                continue;
+            if (scan->task_count == cap) {
+                tmp = realloc(scan->tasks, (cap << 1) * sizeof(*scan->tasks));
+                if (!tmp)
+                    return 0;
+                scan->tasks = tmp;
+                cap <<= 1;
+            }
+            scan->tasks[scan->task_count++] = (SortTask){
+                .start = task.start + starts[b],
+                .count = n,
+                .depth = depth + 1,
+            };
+        }
+    }
+    return 1;
+}
+
+// Sort "entries" in byte order of their keys using up to "jobs" threads.
+// Returns 0 if memory allocation failed.
+int sort_entries(StringSetEntry **entries, size_t count, size_t jobs) {
+    SortScan scan = { .entries = entries };
+    pthread_t *threads = NULL;
+    size_t i, started = 0;
+    int ok = 0;
+
+    if (count < 2)
+        return 1;
+
+    scan.tmp = malloc(count * sizeof(*scan.tmp));
+    scan.oracle = malloc(count * sizeof(*scan.oracle));
+    if (!scan.tmp || !scan.oracle)
+        goto ret;
+
+    if (jobs <= 1 || count < SORT_PARALLEL_THRESHOLD) {
+        sort_msd(entries, scan.tmp, scan.oracle, count, 0);
+        ok = 1;
+        goto ret;
+    }
+
+    if (!sort_split_tasks(&scan, count, jobs))
+        goto ret;
+    if (jobs > scan.task_count)
+        jobs = scan.task_count;
+
+    atomic_init(&scan.next_task, 0);
+    threads = calloc(jobs, sizeof(*threads));
+    if (threads) {
+        for (i = 0; i < jobs; i++) {
+            if (pthread_create(&threads[i], NULL, sort_worker_run, &scan) != 0)
+                break;
+            started++;
+        }
+    }
+    // finish the remaining tasks on this thread, which also covers the case
+    // where no worker could be started
+    sort_worker_run(&scan);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    ok = 1;
+
+ret:
+    free(threads);
+    free(scan.tasks);
+    free(scan.oracle);
+    free(scan.tmp);
+    return ok;
+}
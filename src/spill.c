@@ -0,0 +1,399 @@
+// Exact sorted unique output for sets that don't fit in memory. Once the exact
+// set goes over the memory limit, its keys are sorted and written to a run file
+// (records of key length, count and key bytes) and the set starts over empty.
+// At the end, the runs and what's left in the set are merged with a loser tree:
+// keys equal across runs are printed once, with their counts added up.
+//
+// Run files are unlinked right after they're created, so they're gone when the
+// process exits, whatever the reason.
+
+static const size_t SPILL_MIN_MEMORY_LIMIT = STH_BASE_MB(1);
+static const size_t SPILL_MIN_READ_BUFFER_SIZE = STH_BASE_KB(64);
+static const size_t SPILL_MAX_READ_BUFFER_SIZE = STH_BASE_MB(1);
+// the entry pointer array, the sort's scratch array and its oracle byte
+static const size_t SPILL_SORT_BYTES_PER_ENTRY = 3 * sizeof(void *) + sizeof(uint16_t);
+
+typedef struct {
+    uint64_t length, count;
+} SpillRecordHeader;
+
+typedef struct {
+    const char *dir;
+    size_t memory_limit;
+    // run files, open for reading and writing and already unlinked
+    int *runs;
+    size_t run_count, run_cap;
+    // errno of a failed run file operation
+    int error;
+} Spill;
+
+// A sorted stream of keys, either a run file or the sorted entries still in
+// the set.
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t buffer_size, len, pos;
+    // keys that don't fit in the rest of the buffer are copied here
+    char *key_buffer;
+    size_t key_cap;
+
+    StringSetEntry **entries;
+    size_t entry_count, next_entry;
+
+    const char *key;
+    size_t length, count;
+    int done;
+} SpillSource;
+
+typedef struct {
+    SpillSource *sources;
+    // losers[0] is the winner, losers[1..k) the losers of the inner nodes
+    size_t *losers;
+    size_t k;
+} SpillMerge;
+
+void spill_init(Spill *spill, const char *dir, size_t memory_limit) {
+    *spill = (Spill){
+        .dir = dir,
+        .memory_limit = (memory_limit < SPILL_MIN_MEMORY_LIMIT) ? SPILL_MIN_MEMORY_LIMIT : memory_limit,
+    };
+}
+
+// Memory the set would use to sort its keys, compared to the limit.
+static inline int spill_over_limit(const Spill *spill, const StringSet *set) {
+    return string_set_memory(set) + set->count * SPILL_SORT_BYTES_PER_ENTRY > spill->memory_limit;
+}
+
+static int spill_open_run(Spill *spill) {
+    const char name[] = "/gruniq-XXXXXX";
+    size_t dir_length = strlen(spill->dir);
+    char *path;
+    int fd, *runs;
+
+    if (spill->run_count == spill->run_cap) {
+        runs = realloc(spill->runs, (spill->run_cap ? spill->run_cap << 1 : 16) * sizeof(*runs));
+        if (!runs)
+            return -1;
+        spill->runs = runs;
+        spill->run_cap = spill->run_cap ? spill->run_cap << 1 : 16;
+    }
+
+    if ( !(path = malloc(dir_length + sizeof(name))))
+        return -1;
+    memcpy(path, spill->dir, dir_length);
+    memcpy(path + dir_length, name, sizeof(name));
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        spill->error = errno;
+    } else {
+        unlink(path);
+        spill->runs[spill->run_count++] = fd;
+    }
+    free(path);
+    return fd;
+}
+
+// Sort the keys of "set", write them to a new run file and clear the set.
+// Returns 0 on failure, "error" is set if it was a file error.
+int spill_write_run(Spill *spill, StringSet *set, size_t jobs) {
+    sth_io_writer_t writer;
+    StringSetEntry **entries;
+    SpillRecordHeader header;
+    size_t i;
+    int fd, ok = 0;
+
+    if (set->count == 0)
+        return 1;
+    if ( !(entries = string_set_entries(set)))
+        return 0;
+    if (!sort_entries(entries, set->count, jobs) || (fd = spill_open_run(spill)) < 0) {
+        free(entries);
+        return 0;
+    }
+    if (!sth_io_writer_init(&writer, fd, STH_IO_WRITER_DEFAULT_BUFFER_SIZE)) {
+        free(entries);
+        return 0;
+    }
+
+    for (i = 0; i < set->count; i++) {
+        header = (SpillRecordHeader){ .length = entries[i]->length, .count = entries[i]->count };
+        if (!sth_io_writer_write(&writer, &header, sizeof(header))
+            || !sth_io_writer_write_ref(&writer, entries[i]->key, entries[i]->length))
+        {
+            break;
+        }
+    }
+    // the keys are referenced until the flush, the set is cleared after it
+    if (sth_io_writer_flush(&writer) && !writer.error)
+        ok = 1;
+    else
+        spill->error = writer.error;
+
+    sth_io_writer_deinit(&writer);
+    free(entries);
+    return ok && string_set_clear(set);
+}
+
+// Make at least "size" bytes readable at the buffer's position, moving the
+// unread bytes to the front first. Returns 0 at the end of the file or on a
+// read error.
+static int spill_source_fill(Spill *spill, SpillSource *source, size_t size) {
+    ssize_t n;
+
+    if (source->pos > 0) {
+        memmove(source->buffer, source->buffer + source->pos, source->len - source->pos);
+        source->len -= source->pos;
+        source->pos = 0;
+    }
+    while (source->len < size) {
+        n = read(source->fd, source->buffer + source->len, source->buffer_size - source->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                spill->error = errno;
+            // a run that ends in the middle of a record is corrupted
+            else if (source->len > 0)
+                spill->error = EIO;
+            return 0;
+        }
+        source->len += (size_t)n;
+    }
+    return 1;
+}
+
+// Read "size" bytes that may be bigger than the buffer into "dst".
+static int spill_source_read(Spill *spill, SpillSource *source, char *dst, size_t size) {
+    size_t available;
+
+    while (size > 0) {
+        if (source->pos == source->len && !spill_source_fill(spill, source, 1))
+            return 0;
+        available = source->len - source->pos;
+        if (available > size)
+            available = size;
+        memcpy(dst, source->buffer + source->pos, available);
+        source->pos += available;
+        dst += available;
+        size -= available;
+    }
+    return 1;
+}
+
+// Move to the next key of the source, sets "done" at its end. Returns 0 on a
+// read error or if memory allocation failed.
+static int spill_source_advance(Spill *spill, SpillSource *source) {
+    SpillRecordHeader header;
+    char *key_buffer;
+
+    if (source->fd < 0) {
+        if (source->next_entry == source->entry_count) {
+            source->done = 1;
+            return 1;
+        }
+        const StringSetEntry *entry = source->entries[source->next_entry++];
+        source->key = entry->key;
+        source->length = entry->length;
+        source->count = entry->count;
+        return 1;
+    }
+
+    if (source->len - source->pos < sizeof(header) && !spill_source_fill(spill, source, sizeof(header))) {
+        source->done = 1;
+        return !spill->error;
+    }
+    memcpy(&header, source->buffer + source->pos, sizeof(header));
+    source->pos += sizeof(header);
+    source->length = (size_t)header.length;
+    source->count = (size_t)header.count;
+
+    // the key is used in-place when it's all in the buffer
+    if (source->length <= source->buffer_size) {
+        if (source->len - source->pos < source->length
+            && !spill_source_fill(spill, source, source->length))
+        {
+            spill->error = spill->error ? spill->error : EIO;
+            return 0;
+        }
+        source->key = source->buffer + source->pos;
+        source->pos += source->length;
+        return 1;
+    }
+
+    if (source->length > source->key_cap) {
+        if ( !(key_buffer = realloc(source->key_buffer, source->length)))
+            return 0;
+        source->key_buffer = key_buffer;
+        source->key_cap = source->length;
+    }
+    if (!spill_source_read(spill, source, source->key_buffer, source->length)) {
+        spill->error = spill->error ? spill->error : EIO;
+        return 0;
+    }
+    source->key = source->key_buffer;
+    return 1;
+}
+
+// Finished sources are bigger than everything else.
+static int spill_source_less(const SpillSource *x, const SpillSource *y) {
+    size_t n;
+    int res;
+
+    if (x->done || y->done)
+        return !x->done && y->done;
+    n = (x->length < y->length) ? x->length : y->length;
+    res = (n > 0) ? memcmp(x->key, y->key, n) : 0;
+    if (res != 0)
+        return res < 0;
+    return x->length < y->length;
+}
+
+// Play the matches of the subtree under "node" and return its winner. Leaves
+// are the nodes [k, 2k).
+static size_t spill_merge_build(SpillMerge *merge, size_t node) {
+    size_t left, right;
+
+    if (node >= merge->k)
+        return node - merge->k;
+    left = spill_merge_build(merge, node << 1);
+    right = spill_merge_build(merge, (node << 1) + 1);
+    if (spill_source_less(&merge->sources[right], &merge->sources[left])) {
+        merge->losers[node] = left;
+        return right;
+    }
+    merge->losers[node] = right;
+    return left;
+}
+
+// The winner moved to its next key, replay the matches on its path to the root.
+static void spill_merge_replay(SpillMerge *merge) {
+    size_t winner = merge->losers[0], node, tmp;
+
+    for (node = (winner + merge->k) >> 1; node >= 1; node >>= 1) {
+        if (spill_source_less(&merge->sources[merge->losers[node]], &merge->sources[winner])) {
+            tmp = merge->losers[node];
+            merge->losers[node] = winner;
+            winner = tmp;
+        }
+    }
+    merge->losers[0] = winner;
+}
+
+static int spill_print(sth_io_writer_t *writer, const char *key, size_t length, size_t count, int with_counts) {
+    char count_buffer[32];
+    int count_length;
+
+    if (with_counts) {
+        count_length = snprintf(count_buffer, sizeof(count_buffer), "%zu\t", count);
+        if (!sth_io_writer_write(writer, count_buffer, count_length))
+            return 0;
+    }
+    return sth_io_writer_write(writer, key, length) && sth_io_writer_write(writer, "\n", 1);
+}
+
+// Merge the runs and the keys left in "set" to "writer" in byte order, with
+// "count<TAB>" prefixes if "with_counts" is set. Stops early when "stop" is
+// set. Returns 0 on failure, "error" is set if it was a file error.
+int spill_merge(Spill *spill,
+                const StringSet *set,
+                size_t jobs,
+                sth_io_writer_t *writer,
+                int with_counts,
+                const volatile sig_atomic_t *stop)
+{
+    SpillMerge merge = { .k = spill->run_count + 1 };
+    SpillSource *winner;
+    char *pending = NULL, *tmp;
+    size_t i, buffer_size, pending_length = 0, pending_cap = 0, pending_count = 0;
+    int has_pending = 0, ok = 0;
+
+    // split half of the memory limit between the read buffers
+    buffer_size = spill->memory_limit / (merge.k * 2);
+    if (buffer_size < SPILL_MIN_READ_BUFFER_SIZE)
+        buffer_size = SPILL_MIN_READ_BUFFER_SIZE;
+    if (buffer_size > SPILL_MAX_READ_BUFFER_SIZE)
+        buffer_size = SPILL_MAX_READ_BUFFER_SIZE;
+
+    merge.sources = calloc(merge.k, sizeof(*merge.sources));
+    merge.losers = calloc(merge.k, sizeof(*merge.losers));
+    if (!merge.sources || !merge.losers)
+        goto ret;
+
+    // the last source is the set, it needs no file
+    merge.sources[spill->run_count] = (SpillSource){ .fd = -1, .entry_count = set->count };
+    if ( !(merge.sources[spill->run_count].entries = string_set_entries(set))
+        || !sort_entries(merge.sources[spill->run_count].entries, set->count, jobs))
+    {
+        goto ret;
+    }
+    for (i = 0; i < spill->run_count; i++) {
+        merge.sources[i].fd = spill->runs[i];
+        merge.sources[i].buffer_size = buffer_size;
+        if (lseek(spill->runs[i], 0, SEEK_SET) < 0) {
+            spill->error = errno;
+            goto ret;
+        }
+        if ( !(merge.sources[i].buffer = malloc(buffer_size)))
+            goto ret;
+    }
+    for (i = 0; i < merge.k; i++) {
+        if (!spill_source_advance(spill, &merge.sources[i]))
+            goto ret;
+    }
+    merge.losers[0] = spill_merge_build(&merge, 1);
+
+    while (!*stop && !(winner = &merge.sources[merge.losers[0]])->done) {
+        if (has_pending && winner->length == pending_length
+            && (pending_length == 0 || memcmp(winner->key, pending, pending_length) == 0))
+        {
+            pending_count += winner->count;
+        } else {
+            if (has_pending && !spill_print(writer, pending, pending_length, pending_count, with_counts))
+                break;
+            // the winner's key is overwritten when it advances
+            if (winner->length > pending_cap) {
+                if ( !(tmp = realloc(pending, winner->length)))
+                    goto ret;
+                pending = tmp;
+                pending_cap = winner->length;
+            }
+            if (winner->length > 0)
+                memcpy(pending, winner->key, winner->length);
+            pending_length = winner->length;
+            pending_count = winner->count;
+            has_pending = 1;
+        }
+
+        if (!spill_source_advance(spill, winner))
+            goto ret;
+        spill_merge_replay(&merge);
+    }
+    if (has_pending && !*stop)
+        spill_print(writer, pending, pending_length, pending_count, with_counts);
+    ok = 1;
+
+ret:
+    if (merge.sources) {
+        for (i = 0; i < merge.k; i++) {
+            free(merge.sources[i].buffer);
+            free(merge.sources[i].key_buffer);
+            free(merge.sources[i].entries);
+        }
+    }
+    free(merge.sources);
+    free(merge.losers);
+    free(pending);
+    return ok;
+}
+
+// Close the run files. "error" is kept, so it can be reported afterwards.
+void spill_deinit(Spill *spill) {
+    size_t i;
+
+    for (i = 0; i < spill->run_count; i++)
+        close(spill->runs[i]);
+    free(spill->runs);
+    spill->runs = NULL;
+    spill->run_count = spill->run_cap = 0;
+}
@@ -28,6 +28,262 @@ ret:
     return content;
 }
 
+int sth_io_file_view_open(const char *path, sth_io_file_view_t *view_out) {
+    size_t cap = 0, size = 0, nread;
+    char *data = NULL, *tmp;
+    void *map = NULL;
+    FILE *fp;
+
+    if (sth_os_file_map(path, &map, &size)) {
+        *view_out = (sth_io_file_view_t){
+            .data = STH_BASE_DECLTYPE(data) map,
+            .size = size,
+            .mapped = 1,
+        };
+        return STH_OK;
+    }
+
+    // The file can't be mapped, so read it until EOF. The size is unknown
+    // up-front for non-regular files, so the buffer grows as needed.
+    if ( !(fp = fopen(path, "rb")))
+        return STH_FAILED;
+
+    do {
+        if (cap - size < STH_IO_FILE_VIEW_READ_SIZE) {
+            cap = (cap) ? (cap << 1) : STH_IO_FILE_VIEW_READ_SIZE;
+            tmp = STH_BASE_DECLTYPE(tmp) STH_BASE_REALLOC(data, cap);
+            if (!tmp) {
+                STH_BASE_FREE(data);
+                fclose(fp);
+                return STH_FAILED;
+            }
+            data = tmp;
+        }
+        nread = fread(data + size, sizeof(*data), cap - size, fp);
+        size += nread;
+    } while (nread > 0);
+
+    if (ferror(fp)) {
+        STH_BASE_FREE(data);
+        fclose(fp);
+        return STH_FAILED;
+    }
+    fclose(fp);
+
+    *view_out = (sth_io_file_view_t){
+        .data = data,
+        .size = size,
+        .mapped = 0,
+    };
+    return STH_OK;
+}
+
+void sth_io_file_view_close(sth_io_file_view_t *view) {
+    if (view->mapped)
+        sth_os_file_unmap(view->data, view->size);
+    else
+        STH_BASE_FREE(view->data);
+    *view = (sth_io_file_view_t){ 0 };
+}
+
+int sth_io_reader_init(sth_io_reader_t *reader, int fd, size_t chunk_size) {
+    if (chunk_size == 0)
+        chunk_size = STH_IO_READER_DEFAULT_CHUNK_SIZE;
+
+    *reader = (sth_io_reader_t){
+        .fd = fd,
+        .eof = 0,
+        .buffer = STH_BASE_DECLTYPE(reader->buffer) STH_BASE_MALLOC(chunk_size),
+        .cap = chunk_size,
+        .chunk_size = chunk_size,
+        .len = 0,
+        .consumed = 0,
+    };
+    return (reader->buffer != NULL);
+}
+
+// A read interrupted by a signal isn't retried, the caller may want to stop.
+static ptrdiff_t sth_io_fd_read(int fd, void *buf, size_t size) {
+    ptrdiff_t nread;
+#ifdef STH_PLATFORM_UNIX
+    nread = read(fd, buf, size);
+#else
+    nread = _read(fd, buf, (unsigned int)size);
+#endif
+    return nread;
+}
+
+int sth_io_reader_next(sth_io_reader_t *reader, char **chunk_out, size_t *size_out) {
+    size_t scanned, i;
+    ptrdiff_t nread;
+    char *tmp;
+
+    // move the carried over tail to the start of the buffer
+    reader->len -= reader->consumed;
+    memmove(reader->buffer, reader->buffer + reader->consumed, reader->len);
+    reader->consumed = 0;
+    scanned = reader->len;
+
+    while (!reader->eof) {
+        if (reader->len == reader->cap) {
+            // a single line is longer than the buffer
+            tmp = STH_BASE_DECLTYPE(tmp) STH_BASE_REALLOC(reader->buffer, reader->cap << 1);
+            if (!tmp)
+                return STH_FAILED;
+            reader->buffer = tmp;
+            reader->cap <<= 1;
+        }
+
+        nread = sth_io_fd_read(reader->fd, reader->buffer + reader->len,
+                               reader->cap - reader->len);
+        if (nread < 0)
+            return STH_FAILED;
+        if (nread == 0)
+            reader->eof = 1;
+        reader->len += nread;
+
+        if (reader->eof)
+            break;
+        if (reader->len < reader->chunk_size)
+            continue;
+
+        // cut the chunk after the last newline
+        for (i = reader->len; i > scanned; i--) {
+            if (reader->buffer[i - 1] == '\n') {
+                reader->consumed = i;
+                goto ret_chunk;
+            }
+        }
+        scanned = reader->len;
+    }
+
+    // end of input, the rest is the last chunk, it isn't cut at its last newline
+    if (reader->len == 0)
+        return STH_FAILED;
+    reader->consumed = reader->len;
+
+ret_chunk:
+    *chunk_out = reader->buffer;
+    *size_out = reader->consumed;
+    return STH_OK;
+}
+
+void sth_io_reader_deinit(sth_io_reader_t *reader) {
+    STH_BASE_FREE(reader->buffer);
+    *reader = (sth_io_reader_t){ 0 };
+}
+
+int sth_io_writer_init(sth_io_writer_t *writer, int fd, size_t buffer_size) {
+    if (buffer_size == 0)
+        buffer_size = STH_IO_WRITER_DEFAULT_BUFFER_SIZE;
+
+    writer->fd = fd;
+    writer->error = 0;
+    writer->buffer = STH_BASE_DECLTYPE(writer->buffer) STH_BASE_MALLOC(buffer_size);
+    writer->cap = buffer_size;
+    writer->len = 0;
+    writer->iov_count = 0;
+    return (writer->buffer != NULL);
+}
+
+static ptrdiff_t sth_io_fd_writev(int fd, sth_io_iovec_t *iov, size_t count) {
+    ptrdiff_t nwritten;
+#ifdef STH_PLATFORM_UNIX
+    do {
+        nwritten = writev(fd, iov, (int)count);
+    } while (nwritten < 0 && errno == EINTR);
+#else
+    (void)count;
+    nwritten = _write(fd, iov->iov_base, (unsigned int)iov->iov_len);
+#endif
+    return nwritten;
+}
+
+int sth_io_writer_flush(sth_io_writer_t *writer) {
+    sth_io_iovec_t *iov = writer->iov;
+    size_t count = writer->iov_count;
+    ptrdiff_t nwritten;
+
+    while (count > 0 && !writer->error) {
+        nwritten = sth_io_fd_writev(writer->fd, iov, count);
+        if (nwritten < 0) {
+            writer->error = errno;
+            break;
+        }
+
+        // skip what has been written, a partial write may stop in an iovec
+        while (count > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+
+    writer->len = 0;
+    writer->iov_count = 0;
+    return (writer->error == 0);
+}
+
+static int sth_io_writer_push(sth_io_writer_t *writer, const void *data, size_t size) {
+    sth_io_iovec_t *last;
+
+    if (writer->iov_count == STH_IO_WRITER_MAX_IOVECS && !sth_io_writer_flush(writer))
+        return STH_FAILED;
+
+    last = &writer->iov[writer->iov_count];
+    last->iov_base = (void*)data;
+    last->iov_len = size;
+    writer->iov_count++;
+    return STH_OK;
+}
+
+int sth_io_writer_write(sth_io_writer_t *writer, const void *data, size_t size) {
+    sth_io_iovec_t *last;
+    char *dest;
+
+    if (writer->error)
+        return STH_FAILED;
+    if (size > writer->cap) {
+        // too big for the buffer, write it out in-place
+        return sth_io_writer_push(writer, data, size) && sth_io_writer_flush(writer);
+    }
+    if ((writer->cap - writer->len < size || writer->iov_count == STH_IO_WRITER_MAX_IOVECS)
+        && !sth_io_writer_flush(writer))
+    {
+        return STH_FAILED;
+    }
+
+    dest = writer->buffer + writer->len;
+    memcpy(dest, data, size);
+    writer->len += size;
+
+    // extend the last iovec if it ends where the copy starts
+    last = (writer->iov_count) ? &writer->iov[writer->iov_count - 1] : NULL;
+    if (last && (char*)last->iov_base + last->iov_len == dest) {
+        last->iov_len += size;
+        return STH_OK;
+    }
+    return sth_io_writer_push(writer, dest, size);
+}
+
+int sth_io_writer_write_ref(sth_io_writer_t *writer, const void *data, size_t size) {
+    if (size < STH_IO_WRITER_REF_THRESHOLD)
+        return sth_io_writer_write(writer, data, size);
+    if (writer->error)
+        return STH_FAILED;
+    return sth_io_writer_push(writer, data, size);
+}
+
+void sth_io_writer_deinit(sth_io_writer_t *writer) {
+    STH_BASE_FREE(writer->buffer);
+    writer->buffer = NULL;
+    writer->len = writer->cap = writer->iov_count = 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,8 +5,88 @@
 extern "C" {
 #endif
 
+#define STH_IO_FILE_VIEW_READ_SIZE STH_BASE_KB(64)
+
+// A read-only view over a file's content. Regular files are memory mapped, so
+// the pages are shared with the page cache and loaded on demand. Anything else
+// (pipes, character devices, ...) is read into a heap buffer instead.
+typedef struct sth_io_file_view {
+    char *data;
+    size_t size;
+    // non-zero if "data" is a memory mapping and not a heap buffer
+    int mapped;
+} sth_io_file_view_t;
+
+#define STH_IO_READER_DEFAULT_CHUNK_SIZE STH_BASE_MB(1)
+
+// Reads a file descriptor in fixed-size chunks where every chunk ends at a line
+// boundary. The incomplete last line of a read is carried over to the start of
+// the next chunk, so memory usage is bounded by the chunk size plus the longest
+// line, no matter how big the input is.
+typedef struct sth_io_reader {
+    int fd, eof;
+    char *buffer;
+    size_t cap, chunk_size;
+    // [0, consumed) is the last chunk handed out and [consumed, len) is the
+    // carried over tail
+    size_t len, consumed;
+} sth_io_reader_t;
+
+#define STH_IO_WRITER_DEFAULT_BUFFER_SIZE STH_BASE_MB(1)
+#define STH_IO_WRITER_MAX_IOVECS 1024
+// referenced data smaller than this is copied, since a copy is cheaper than
+// an extra iovec
+#define STH_IO_WRITER_REF_THRESHOLD 256
+
+#ifdef STH_PLATFORM_UNIX
+    typedef struct iovec sth_io_iovec_t;
+#else
+    typedef struct {
+        void *iov_base;
+        size_t iov_len;
+    } sth_io_iovec_t;
+#endif
+
+// Buffered writer for a file descriptor. Small writes are copied into a large
+// buffer and big ones can be referenced in-place, everything is written out
+// with a single writev() call per flush. After a failed write the writer keeps
+// the error (an errno value) and drops further data.
+typedef struct sth_io_writer {
+    int fd, error;
+    char *buffer;
+    size_t cap, len;
+    sth_io_iovec_t iov[STH_IO_WRITER_MAX_IOVECS];
+    size_t iov_count;
+} sth_io_writer_t;
+
 char *sth_io_file_read_all(const char *path, size_t *out_file_size);
 
+int sth_io_file_view_open(const char *path, sth_io_file_view_t *view_out);
+
+void sth_io_file_view_close(sth_io_file_view_t *view);
+
+int sth_io_reader_init(sth_io_reader_t *reader, int fd, size_t chunk_size);
+
+// Get the next chunk. The chunk is valid until the next call. Returns
+// STH_FAILED at the end of input or on a read error (errno is set). After a
+// read interrupted by a signal (EINTR) the call can be repeated.
+int sth_io_reader_next(sth_io_reader_t *reader, char **chunk_out, size_t *size_out);
+
+void sth_io_reader_deinit(sth_io_reader_t *reader);
+
+int sth_io_writer_init(sth_io_writer_t *writer, int fd, size_t buffer_size);
+
+// Copy "data" into the writer's buffer.
+int sth_io_writer_write(sth_io_writer_t *writer, const void *data, size_t size);
+
+// Queue "data" without copying it. It must stay valid until the next flush.
+int sth_io_writer_write_ref(sth_io_writer_t *writer, const void *data, size_t size);
+
+int sth_io_writer_flush(sth_io_writer_t *writer);
+
+// Release the buffer without flushing it.
+void sth_io_writer_deinit(sth_io_writer_t *writer);
+
 #ifdef __cplusplus
 }
 #endif
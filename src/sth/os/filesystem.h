@@ -13,6 +13,13 @@ int sth_os_rename(const char *old_path, const char *new_path);
 
 int sth_os_mkdir_if_not_exists(const char *path);
 
+// Map a regular file into memory as a private read-only view. The mapping is
+// hinted for sequential access and read-ahead. An empty file is mapped to NULL
+// with zero size. Fails on files that can't be mapped (pipes, devices, ...).
+int sth_os_file_map(const char *path, void **map_out, size_t *size_out);
+
+void sth_os_file_unmap(void *p, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
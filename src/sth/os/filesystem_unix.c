@@ -36,6 +36,41 @@ int sth_os_mkdir_if_not_exists(const char *path) {
     return STH_OK;
 }
 
+int sth_os_file_map(const char *path, void **map_out, size_t *size_out) {
+    struct stat statbuf;
+    void *p = NULL;
+    int fd, res = STH_FAILED;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return STH_FAILED;
+
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+        goto ret_close_file;
+
+    if (statbuf.st_size > 0) {
+        p = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            goto ret_close_file;
+        // hints are best-effort, a failure here doesn't invalidate the mapping
+        madvise(p, statbuf.st_size, MADV_SEQUENTIAL);
+        madvise(p, statbuf.st_size, MADV_WILLNEED);
+    }
+
+    *map_out = p;
+    *size_out = statbuf.st_size;
+    res = STH_OK;
+ret_close_file:
+    // the mapping keeps a reference to the file, so the descriptor is not needed
+    close(fd);
+    return res;
+}
+
+void sth_os_file_unmap(void *p, size_t size) {
+    if (p)
+        munmap(p, size);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,44 @@ int sth_os_mkdir_if_not_exists(const char *path) {
     return STH_OK;
 }
 
+int sth_os_file_map(const char *path, void **map_out, size_t *size_out) {
+    LARGE_INTEGER file_size;
+    HANDLE file, mapping;
+    void *p = NULL;
+    int res = STH_FAILED;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return STH_FAILED;
+
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &file_size))
+        goto ret_close_file;
+
+    if (file_size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping)
+            goto ret_close_file;
+        p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!p)
+            goto ret_close_file;
+    }
+
+    *map_out = p;
+    *size_out = (size_t)file_size.QuadPart;
+    res = STH_OK;
+ret_close_file:
+    CloseHandle(file);
+    return res;
+}
+
+void sth_os_file_unmap(void *p, size_t size) {
+    (void)size;
+    if (p)
+        UnmapViewOfFile(p);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,3 +9,9 @@
 #else
     #include "filesystem_windows.c"
 #endif
+
+#ifdef STH_PLATFORM_UNIX
+    #include "time_unix.c"
+#else
+    #include "time_windows.c"
+#endif
@@ -3,5 +3,6 @@
 
 #include "memory.h"
 #include "filesystem.h"
+#include "time.h"
 
 #endif // _STH_OS_OS_H_
@@ -0,0 +1,16 @@
+#ifndef _STH_OS_TIME_H_
+#define _STH_OS_TIME_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Nanoseconds of a monotonic clock, only meaningful as a difference between
+// two calls.
+uint64_t sth_os_time_ns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STH_OS_TIME_H_
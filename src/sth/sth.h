@@ -38,7 +38,10 @@
 #ifdef STH_PLATFORM_UNIX
     #include <sys/mman.h>
     #include <sys/stat.h>
+    #include <sys/uio.h>
+    #include <fcntl.h>
     #include <unistd.h>
+    #include <time.h>
 #else
     #include <memoryapi.h>
     #include <sysinfoapi.h>
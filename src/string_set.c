@@ -0,0 +1,303 @@
+// An exact set of byte strings. Keys are copied into an arena and indexed by an
+// open-addressing table split in groups of 16 slots. Every slot has a control
+// byte holding 7 bits of the key's hash (or STRING_SET_EMPTY), so a whole group
+// is probed with a single SIMD compare. The full 64-bit hash is stored next to
+// the key, so growing the table never touches (or rehashes) the keys. Every
+// entry also counts how many times its key has been inserted.
+//
+// Keys can be made of several fields, they're stored joined with tabs, the way
+// they're printed. Two keys that only differ in where their tabs are would be
+// equal, but their hashes already tell them apart.
+
+#define STRING_SET_GROUP_SIZE 16
+#define STRING_SET_EMPTY 0x80
+
+static const size_t STRING_SET_MIN_CAPACITY = 1024;
+static const size_t STRING_SET_ARENA_RESERVE_SIZE = STH_BASE_MB(64);
+static const size_t STRING_SET_ARENA_COMMIT_SIZE = STH_BASE_MB(1);
+
+typedef struct {
+    uint64_t hash;
+    const char *key;
+    size_t length, count;
+} StringSetEntry;
+
+typedef struct {
+    sth_arena_t *arena;
+    uint8_t *ctrl;
+    StringSetEntry *entries;
+    // capacity is always a power of 2 and a multiple of the group size
+    size_t capacity, count;
+} StringSet;
+
+static inline uint8_t string_set_h2(uint64_t hash) {
+    return (uint8_t)(hash >> 57);
+}
+
+// Bit i of the result is set if ctrl[i] == byte.
+static inline uint32_t string_set_group_match(const uint8_t *ctrl, uint8_t byte) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < STRING_SET_GROUP_SIZE; i++)
+        mask |= (uint32_t)(ctrl[i] == byte) << i;
+    return mask;
+#endif
+}
+
+static inline int string_set_bit_index(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+static int string_set_alloc_table(StringSet *set, size_t capacity) {
+    set->ctrl = malloc(capacity);
+    set->entries = malloc(capacity * sizeof(*set->entries));
+    if (!set->ctrl || !set->entries) {
+        free(set->ctrl);
+        free(set->entries);
+        return 0;
+    }
+    memset(set->ctrl, STRING_SET_EMPTY, capacity);
+    set->capacity = capacity;
+    return 1;
+}
+
+// Length of the fields joined with tabs.
+static inline size_t string_set_key_length(const HashField *fields, size_t count) {
+    size_t i, length = count - 1;
+
+    for (i = 0; i < count; i++)
+        length += fields[i].length;
+    return length;
+}
+
+static inline int string_set_key_equal(const StringSetEntry *entry, const HashField *fields, size_t count) {
+    const char *key = entry->key;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (fields[i].length > 0 && memcmp(key, fields[i].data, fields[i].length) != 0)
+            return 0;
+        key += fields[i].length + 1;
+    }
+    return 1;
+}
+
+// Find the slot of the key or the empty slot where it belongs. Since entries
+// are never removed, the first group with an empty slot ends the probe
+// sequence.
+static size_t string_set_find_slot(const StringSet *set,
+                                   uint64_t hash,
+                                   const HashField *fields,
+                                   size_t count,
+                                   size_t length,
+                                   int *found)
+{
+    const size_t group_mask = (set->capacity / STRING_SET_GROUP_SIZE) - 1;
+    const uint8_t h2 = string_set_h2(hash);
+    size_t group = hash & group_mask, step = 0, slot;
+    uint32_t mask;
+
+    for (;;) {
+        const uint8_t *ctrl = set->ctrl + group * STRING_SET_GROUP_SIZE;
+
+        mask = string_set_group_match(ctrl, h2);
+        while (mask) {
+            slot = group * STRING_SET_GROUP_SIZE + string_set_bit_index(mask);
+            const StringSetEntry *entry = &set->entries[slot];
+            if (entry->hash == hash && entry->length == length
+                && (length == 0 || string_set_key_equal(entry, fields, count)))
+            {
+                *found = 1;
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+
+        mask = string_set_group_match(ctrl, STRING_SET_EMPTY);
+        if (mask) {
+            *found = 0;
+            return group * STRING_SET_GROUP_SIZE + string_set_bit_index(mask);
+        }
+
+        // triangular probing visits every group when the group count is a power of 2
+        step++;
+        group = (group + step) & group_mask;
+    }
+}
+
+static size_t string_set_find_empty_slot(const StringSet *set, uint64_t hash) {
+    const size_t group_mask = (set->capacity / STRING_SET_GROUP_SIZE) - 1;
+    size_t group = hash & group_mask, step = 0;
+    uint32_t mask;
+
+    while ( !(mask = string_set_group_match(set->ctrl + group * STRING_SET_GROUP_SIZE,
+                                            STRING_SET_EMPTY)))
+    {
+        step++;
+        group = (group + step) & group_mask;
+    }
+    return group * STRING_SET_GROUP_SIZE + string_set_bit_index(mask);
+}
+
+static int string_set_grow(StringSet *set) {
+    StringSet grown = *set;
+    size_t i, slot;
+
+    if (!string_set_alloc_table(&grown, set->capacity << 1))
+        return 0;
+
+    for (i = 0; i < set->capacity; i++) {
+        if (set->ctrl[i] == STRING_SET_EMPTY)
+            continue;
+        slot = string_set_find_empty_slot(&grown, set->entries[i].hash);
+        grown.ctrl[slot] = set->ctrl[i];
+        grown.entries[slot] = set->entries[i];
+    }
+
+    free(set->ctrl);
+    free(set->entries);
+    *set = grown;
+    return 1;
+}
+
+int string_set_init(StringSet *set, size_t initial_capacity) {
+    sth_arena_config_t arena_config = STH_ARENA_DEFAULT_CONFIG;
+    size_t capacity = STRING_SET_MIN_CAPACITY;
+
+    while (capacity < initial_capacity)
+        capacity <<= 1;
+
+    *set = (StringSet){ 0 };
+    arena_config.reserve = STRING_SET_ARENA_RESERVE_SIZE;
+    arena_config.commit = STRING_SET_ARENA_COMMIT_SIZE;
+    if ( !(set->arena = sth_arena_new(arena_config)))
+        return 0;
+
+    if (!string_set_alloc_table(set, capacity)) {
+        sth_arena_destroy(set->arena);
+        return 0;
+    }
+    return 1;
+}
+
+// Find the entry of the key made of "count" fields, inserting a copy of the key
+// with a zero count if it's not in the set. "inserted" tells which one
+// happened. Returns NULL if memory allocation failed. The entry is valid until
+// the next insertion.
+StringSetEntry *string_set_upsert(StringSet *set,
+                                  uint64_t hash,
+                                  const HashField *fields,
+                                  size_t count,
+                                  int *inserted)
+{
+    const size_t length = string_set_key_length(fields, count);
+    size_t slot, i;
+    char *copy = NULL, *p;
+    int found;
+
+    slot = string_set_find_slot(set, hash, fields, count, length, &found);
+    *inserted = !found;
+    if (found)
+        return &set->entries[slot];
+
+    // keep the load factor at or below 7/8
+    if ((set->count + 1) * 8 > set->capacity * 7) {
+        if (!string_set_grow(set))
+            return NULL;
+        slot = string_set_find_empty_slot(set, hash);
+    }
+
+    if (length > 0) {
+        copy = sth_arena_alloc_align(set->arena, length, 1);
+        if (!copy)
+            return NULL;
+        for (i = 0, p = copy; i < count; i++) {
+            if (i > 0)
+                *p++ = '\t';
+            memcpy(p, fields[i].data, fields[i].length);
+            p += fields[i].length;
+        }
+    }
+
+    // an empty key isn't NULL either, it's passed to memcpy and memcmp
+    set->ctrl[slot] = string_set_h2(hash);
+    set->entries[slot] = (StringSetEntry){
+        .hash = hash,
+        .key = (length > 0) ? copy : "",
+        .length = length,
+        .count = 0,
+    };
+    set->count++;
+    return &set->entries[slot];
+}
+
+// Insert a copy of the key and count the occurrence. Returns 1 if the key was
+// inserted, 0 if it was already in the set and -1 if memory allocation failed.
+int string_set_insert(StringSet *set, uint64_t hash, const HashField *fields, size_t count) {
+    StringSetEntry *entry;
+    int inserted;
+
+    if ( !(entry = string_set_upsert(set, hash, fields, count, &inserted)))
+        return -1;
+    entry->count++;
+    return inserted;
+}
+
+// Collect pointers to all the entries in table order. The caller frees the
+// returned array, NULL is returned if allocation fails.
+StringSetEntry **string_set_entries(const StringSet *set) {
+    StringSetEntry **entries;
+    size_t i, n = 0;
+
+    entries = malloc((set->count ? set->count : 1) * sizeof(*entries));
+    if (!entries)
+        return NULL;
+
+    for (i = 0; i < set->capacity; i++) {
+        if (set->ctrl[i] != STRING_SET_EMPTY)
+            entries[n++] = &set->entries[i];
+    }
+    return entries;
+}
+
+// Bytes used by the stored keys and the table.
+size_t string_set_memory(const StringSet *set) {
+    return sth_arena_pos(set->arena) + set->capacity * (1 + sizeof(*set->entries));
+}
+
+// Drop all the keys and shrink the table back to its minimum capacity. Returns
+// 0 if memory allocation failed.
+int string_set_clear(StringSet *set) {
+    free(set->ctrl);
+    free(set->entries);
+    set->count = 0;
+    sth_arena_reset(set->arena);
+    if (!string_set_alloc_table(set, STRING_SET_MIN_CAPACITY)) {
+        set->ctrl = NULL;
+        set->entries = NULL;
+        set->capacity = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void string_set_deinit(StringSet *set) {
+    free(set->ctrl);
+    free(set->entries);
+    if (set->arena)
+        sth_arena_destroy(set->arena);
+    *set = (StringSet){ 0 };
+}